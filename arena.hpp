@@ -0,0 +1,178 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <string_view>
+#include <unordered_set>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Contiguous run of objects owned elsewhere, usually by an arena.
+template<typename T>
+class arena_array
+{
+public:
+	arena_array() = default;
+
+	arena_array(T* data, const std::size_t size) : data_(data), size_(size)
+	{
+
+	}
+
+	T* begin() const { return data_; }
+	T* end() const { return data_ + size_; }
+
+	T& operator[](const std::size_t index) const
+	{
+		return data_[index];
+	}
+
+	[[nodiscard]] std::size_t size() const
+	{
+		return size_;
+	}
+
+	[[nodiscard]] bool empty() const
+	{
+		return size_ == 0;
+	}
+
+private:
+	T* data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+// Bump allocator for objects that all die together. Memory is carved out of large blocks and released in
+// one step when the arena is destroyed, after running the destructors of the objects that need one.
+// Strings interned into the arena are stored once and compare equal by pointer.
+class arena : public std::enable_shared_from_this<arena>
+{
+public:
+	static constexpr std::size_t block_size = 16 * 1024;
+
+	arena() = default;
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	~arena()
+	{
+		for (auto it = destructors_.rbegin(); it != destructors_.rend(); ++it)
+			it->destroy(it->object);
+	}
+
+	static std::shared_ptr<arena> create()
+	{
+		return std::make_shared<arena>();
+	}
+
+	template<typename T, typename ...Args>
+	T* create(Args&&... args)
+	{
+		auto* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+		if constexpr (!std::is_trivially_destructible_v<T>)
+		{
+			destructors_.push_back({ [](void* p) { static_cast<T*>(p)->~T(); }, object });
+		}
+
+		return object;
+	}
+
+	// Copies the elements into arena memory. Only for trivially destructible types.
+	template<typename T>
+	arena_array<T> copy_array(const T* data, const std::size_t count)
+	{
+		static_assert(std::is_trivially_destructible_v<T> && std::is_trivially_copyable_v<T>, "arena arrays hold plain data only");
+
+		if (count == 0)
+			return {};
+
+		auto* copy = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+		std::memcpy(copy, data, sizeof(T) * count);
+
+		return arena_array<T>(copy, count);
+	}
+
+	template<typename T>
+	arena_array<T> copy_array(const std::vector<T>& values)
+	{
+		return copy_array(values.data(), values.size());
+	}
+
+	std::string_view intern(const std::string_view text)
+	{
+		const auto found = interned_.find(text);
+
+		if (found != interned_.end())
+			return *found;
+
+		auto* copy = static_cast<char*>(allocate(text.size() + 1, 1));
+
+		if (!text.empty())
+			std::memcpy(copy, text.data(), text.size());
+
+		copy[text.size()] = '\0';
+
+		return *interned_.emplace(copy, text.size()).first;
+	}
+
+	// Keeps other alive as long as this arena, for objects here that point into it.
+	void adopt(std::shared_ptr<arena> other)
+	{
+		adopted_.push_back(std::move(other));
+	}
+
+	// Bytes handed out so far, not counting block slack.
+	[[nodiscard]] std::size_t bytes_used() const
+	{
+		return bytes_used_;
+	}
+
+	[[nodiscard]] std::size_t block_count() const
+	{
+		return blocks_.size();
+	}
+
+private:
+	void* allocate(const std::size_t size, const std::size_t alignment)
+	{
+		auto offset = (alignment - reinterpret_cast<std::uintptr_t>(cursor_) % alignment) % alignment;
+
+		if (cursor_ == nullptr || offset + size > std::size_t(end_ - cursor_))
+		{
+			// Oversized requests get a block of their own.
+			const auto capacity = std::max(block_size, size + alignment);
+
+			blocks_.emplace_back(new std::byte[capacity]);
+			cursor_ = blocks_.back().get();
+			end_ = cursor_ + capacity;
+
+			offset = (alignment - reinterpret_cast<std::uintptr_t>(cursor_) % alignment) % alignment;
+		}
+
+		auto* result = cursor_ + offset;
+		cursor_ = result + size;
+		bytes_used_ += size;
+
+		return result;
+	}
+
+	struct destructor
+	{
+		void(*destroy)(void*);
+		void* object;
+	};
+
+	std::vector<std::unique_ptr<std::byte[]>> blocks_;
+	std::byte* cursor_ = nullptr;
+	std::byte* end_ = nullptr;
+	std::size_t bytes_used_ = 0;
+	std::vector<destructor> destructors_;
+	std::unordered_set<std::string_view> interned_;
+	std::vector<std::shared_ptr<arena>> adopted_;
+};
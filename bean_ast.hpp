@@ -3,63 +3,170 @@
 #include <memory>
 #include <cstdint>
 #include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
 #include "bean_object.hpp"
 #include "tokenizer.hpp"
+#include "arena.hpp"
+#include "thread_pool.hpp"
 #include <iomanip>
 
 namespace bean {
 
 	class bean_state;
 	class ast;
+	class constant_pool;
+	class compiled_script;
+	class flat_ast;
+	class symbol_table;
+	class precompiled;
+	class bytecode_program;
+
+	enum class flat_node_kind : std::uint8_t
+	{
+		integer,
+		floating,
+		plus,
+		minus,
+		multiply,
+		divide,
+		pow,
+		define_var,
+		variable_reference,
+		ret,
+		define_and_set_var,
+		set_var,
+		function,
+		call,
+		statement_list,
+		lazy_function
+	};
+
+	// Fixed size record of a flat_ast. What the fields hold depends on the kind:
+	//   integer, floating               left = constant index, name = literal text
+	//   binary operators                left, right = operand nodes
+	//   define_var, variable_reference  name
+	//   define_and_set_var, function    name, left = value or body node
+	//   lazy_function                   name, left = index of the unparsed body
+	//   set_var                         name, left = reference node, right = value node
+	//   return                          left = value node
+	//   call, statement_list            name (calls only), left = first entry in operands, right = count
+	struct flat_node
+	{
+		flat_node_kind kind;
+		// Always zero. Records are written to precompiled files as they are, so no byte may be left unset.
+		std::uint8_t reserved[3];
+		std::uint32_t name;
+		std::uint32_t left;
+		std::uint32_t right;
+	};
+
+	static_assert(sizeof(flat_node) == 16, "flat_node records are meant to be 16 bytes");
 
 	class ast_builder
 	{
 	public:
 		static void remove_first_last_token(token_iterator& iterator, const token_type left, const token_type right)
 		{
-			while (iterator.size() >= 2 && iterator.first().get_type() == left && iterator.last().get_type() == right)
+			// The outer brackets only wrap the whole expression when they are each other's partner.
+			while (iterator.size() >= 2 && iterator.first().get_type() == left && iterator.get_match(0) == iterator.size() - 1 && iterator.last().get_type() == right)
 			{
-				int parenCount = 0;
+				iterator.pop_front();
+				iterator.pop_end();
+			}
+		}
 
-				token_iterator paren_iterator(iterator.get_tokens());
+		// Nodes are allocated from nodes, which must be owned by a std::shared_ptr so function definitions
+		// can keep it alive.
+		static ast* parse(const token_stream& tokens, symbol_table& symbols, constant_pool& constants, arena& nodes);
+		static ast* parse(const token_array& tokens, symbol_table& symbols, constant_pool& constants, arena& nodes);
 
-				while (paren_iterator.next().is_valid())
-				{
-					auto parenToken = paren_iterator.here();
+		// Parsing never touches a bean_state, so scripts can be compiled on any thread and linked against
+		// any number of states afterwards.
+		static std::shared_ptr<compiled_script> compile(const token_stream& tokens);
 
-					if (parenToken.get_type() == left)
-					{
-						parenCount++;
-					}
-					else if (parenToken.get_type() == right)
-					{
-						parenCount--;
-						if (paren_iterator.get_index() != iterator.size() - 1 && parenCount == 0)
-						{
-							// We are not at the end of the expression but we have no open parentheses, therefore the start and end parentheses are not linked.
-							goto escapeParen;
-						}
-						else if (parenCount == 0)
-						{
-							// Last element.
-							iterator.pop_front();
-							iterator.pop_end();
-						}
-					}
-				}
-			}
-		escapeParen:
-			return;
-		}
+		// Top-level function bodies are parsed in parallel on pool.
+		static std::shared_ptr<compiled_script> compile(const token_stream& tokens, thread_pool& pool);
 
-		static std::shared_ptr<ast> parse(const token_array& tokens, bean_state& state);
+		// Compiles and links against state in one step.
+		static std::shared_ptr<compiled_script> compile(const token_stream& tokens, const bean_state& state);
+
+		// Compiles the tokens in [first, last). With lazy_functions only the brace range of each function body
+		// is recorded, the body is parsed the first time the function is called. Names used inside a lazy
+		// body are not part of the symbol table and are checked when the body runs.
+		static std::shared_ptr<compiled_script> compile(const std::shared_ptr<const token_stream>& tokens, std::size_t first, std::size_t last, bool lazy_functions);
+
+		static std::shared_ptr<compiled_script> compile(const std::shared_ptr<const token_stream>& tokens, bool lazy_functions);
 	};
 
 	using bean_object_ptr = std::shared_ptr<bean_object>;
-	using bean_objects = std::vector<bean_object_ptr>;
-	using bean_function_caller = std::function<bean_object_ptr(bean_state&)>;
+	using bean_values = std::vector<bean_value>;
+	using bean_function_caller = std::function<bean_value(bean_state&)>;
+
+	// Literal values of a compiled script. Every distinct literal is stored once while parsing and indexed by
+	// the nodes that use it. Constants are immutable once created.
+	class constant_pool
+	{
+	public:
+		bean_value get_integer(const std::int32_t value)
+		{
+			const auto found = integers_.find(value);
+
+			if (found != integers_.end())
+				return constants_[found->second];
+
+			integers_.emplace(value, std::uint32_t(constants_.size()));
+			return constants_.emplace_back(value);
+		}
+
+		bean_value get_double(const double value)
+		{
+			// Keyed on the bit pattern so -0.0 and 0.0 stay distinct constants.
+			std::uint64_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+
+			const auto found = doubles_.find(bits);
+
+			if (found != doubles_.end())
+				return constants_[found->second];
+
+			doubles_.emplace(bits, std::uint32_t(constants_.size()));
+			return constants_.emplace_back(value);
+		}
+
+		// Index of the constant equal to value, which may come from another pool.
+		[[nodiscard]] std::uint32_t index_of(const bean_value& value) const
+		{
+			if (value.type() == BeanObjectType::INT)
+				return integers_.at(value.as_int());
+
+			const auto number = value.as_double();
+			std::uint64_t bits;
+			std::memcpy(&bits, &number, sizeof(bits));
+
+			return doubles_.at(bits);
+		}
+
+		[[nodiscard]] const bean_values& get_constants() const
+		{
+			return constants_;
+		}
+
+		[[nodiscard]] std::size_t size() const
+		{
+			return constants_.size();
+		}
+
+	private:
+		std::unordered_map<std::int32_t, std::uint32_t> integers_;
+		std::unordered_map<std::uint64_t, std::uint32_t> doubles_;
+		bean_values constants_;
+	};
 
-	class bean_function
+	class bean_function : public std::enable_shared_from_this<bean_function>
 	{
 	public:
 		explicit bean_function(const std::string& name)
@@ -72,11 +179,45 @@ namespace bean {
 			return name_;
 		}
 
-		std::shared_ptr<ast> get_ast()
+		const std::shared_ptr<ast>& get_ast() const
 		{
 			return func_ast_;
 		}
 
+		// Body of a script function in flat form, entry is the index of its root node.
+		void set_code(std::shared_ptr<const flat_ast> code, const std::uint32_t entry)
+		{
+			func_code_ = std::move(code);
+			func_entry_ = entry;
+		}
+
+		const std::shared_ptr<const flat_ast>& get_code() const
+		{
+			return func_code_;
+		}
+
+		[[nodiscard]] std::uint32_t get_entry() const
+		{
+			return func_entry_;
+		}
+
+		// Body of a script function as bytecode, function is its index in the program's function table.
+		void set_bytecode(std::shared_ptr<const bytecode_program> program, const std::uint32_t function)
+		{
+			func_bytecode_ = std::move(program);
+			func_bytecode_function_ = function;
+		}
+
+		[[nodiscard]] const std::shared_ptr<const bytecode_program>& get_bytecode() const
+		{
+			return func_bytecode_;
+		}
+
+		[[nodiscard]] std::uint32_t get_bytecode_function() const
+		{
+			return func_bytecode_function_;
+		}
+
 		void set_ast(std::shared_ptr<ast> ast_)
 		{
 			func_ast_ = ast_;
@@ -95,124 +236,433 @@ namespace bean {
 	private:
 		std::string name_;
 		std::shared_ptr<ast> func_ast_;
+		std::shared_ptr<const flat_ast> func_code_;
+		std::uint32_t func_entry_ = 0;
+		std::shared_ptr<const bytecode_program> func_bytecode_;
+		std::uint32_t func_bytecode_function_ = 0;
 		bean_function_caller func_caller_;
 	};
 
 
+	enum class symbol_kind : std::uint8_t
+	{
+		variable,
+		function
+	};
+
+	// Process wide numbering of names of one kind. Names are resolved to their slot when a script is parsed,
+	// every state keeps a variable at the same index of its dense array and caches function lookups by slot.
+	// Slots are never released: the registry grows with the distinct names parsed or loaded over the life of the
+	// process, and a state's arrays grow to the highest slot it defines or calls. Parsers go through a
+	// slot_resolver, so this lock is taken once per distinct name and parse.
+	template<symbol_kind Kind>
+	class name_slots
+	{
+	public:
+		static constexpr std::uint32_t invalid = ~0u;
+
+		static std::uint32_t resolve(const std::string_view name)
+		{
+			auto& slots = instance();
+			std::lock_guard<std::mutex> lock(slots.mutex);
+
+			const auto found = slots.index.find(name);
+
+			if (found != slots.index.end())
+				return found->second;
+
+			const auto slot = std::uint32_t(slots.index.size());
+			slots.index.emplace(name, slot);
+			return slot;
+		}
+
+		// The slot of name or invalid, without assigning one.
+		static std::uint32_t find(const std::string_view name)
+		{
+			auto& slots = instance();
+			std::lock_guard<std::mutex> lock(slots.mutex);
+
+			const auto found = slots.index.find(name);
+			return found != slots.index.end() ? found->second : invalid;
+		}
+
+	private:
+		struct registry
+		{
+			std::mutex mutex;
+			std::map<std::string, std::uint32_t, std::less<>> index;
+		};
+
+		static registry& instance()
+		{
+			static registry slots;
+			return slots;
+		}
+	};
+
+	using variable_slots = name_slots<symbol_kind::variable>;
+	using function_slots = name_slots<symbol_kind::function>;
+
+	// Global variables of a state, indexed by slot. An undefined value is a variable that is not defined.
+	class variable_table
+	{
+	public:
+		// Pointers are invalidated when a variable with a higher slot is defined.
+		bean_value* find(const std::uint32_t slot)
+		{
+			return slot < values_.size() && values_[slot] ? &values_[slot] : nullptr;
+		}
+
+		bean_value* find(const std::string_view name)
+		{
+			return find(variable_slots::find(name));
+		}
+
+		void set(const std::uint32_t slot, bean_value value)
+		{
+			if (slot >= values_.size())
+				values_.resize(std::size_t(slot) + 1);
+
+			values_[slot] = std::move(value);
+		}
+
+		bean_value& operator[](const std::string_view name)
+		{
+			const auto slot = variable_slots::resolve(name);
+
+			if (slot >= values_.size())
+				values_.resize(std::size_t(slot) + 1);
+
+			return values_[slot];
+		}
+
+		[[nodiscard]] std::size_t count(const std::string_view name) const
+		{
+			const auto slot = variable_slots::find(name);
+			return slot < values_.size() && values_[slot] ? 1 : 0;
+		}
+
+		// Number of defined variables.
+		[[nodiscard]] std::size_t size() const
+		{
+			return std::size_t(std::count_if(values_.begin(), values_.end(), [](const bean_value& value) { return bool(value); }));
+		}
+
+		void clear()
+		{
+			values_.clear();
+		}
+
+	private:
+		std::vector<bean_value> values_;
+	};
+
 	class bean_state
 	{
 	public:
+		// Transparent comparator so nodes can look names up by their interned string_view.
+		using function_map = std::map<std::string, std::shared_ptr<bean_function>, std::less<>>;
+
 		bean_state()
 		{
 			variables.clear();
 		}
 
-		std::shared_ptr<bean_function> get_function(const std::string& name)
+		std::shared_ptr<bean_function> get_function(const std::string_view name)
+		{
+			const auto found = functions_.find(name);
+
+			return found != functions_.end() ? found->second : nullptr;
+		}
+
+		// Function a call site resolves to, slot being the function_slots number of name. Lookups are cached
+		// per slot until a binding changes, so a repeated call costs one comparison.
+		BEAN_FORCEINLINE bean_function* find_function(const std::uint32_t slot, const std::string_view name)
+		{
+			if (slot < call_cache_.size() && call_cache_[slot].version == functions_version_)
+				return call_cache_[slot].target;
+
+			return cache_function(slot, name);
+		}
+
+		// Binds name, invalidating every cached call. A binding replaced while a call is running stays alive
+		// until the outermost call returns, the replaced function may be the one running.
+		void set_function(const std::string_view name, std::shared_ptr<bean_function> function)
+		{
+			auto found = functions_.find(name);
+
+			if (found == functions_.end())
+				found = functions_.emplace(std::string(name), nullptr).first;
+			else if (call_depth_ > 0)
+				retired_functions_.push_back(std::move(found->second));
+
+			found->second = std::move(function);
+			functions_version_++;
+		}
+
+		[[nodiscard]] const function_map& get_functions() const
+		{
+			return functions_;
+		}
+
+		// Increases whenever a binding changes.
+		[[nodiscard]] std::uint64_t get_functions_version() const
+		{
+			return functions_version_;
+		}
+
+		// A script or native call in progress, bindings replaced meanwhile are kept until all calls returned.
+		BEAN_FORCEINLINE void enter_call()
 		{
-			for (auto& fun : functions)
+			call_depth_++;
+		}
+
+		BEAN_FORCEINLINE void leave_call()
+		{
+			if (--call_depth_ == 0 && !retired_functions_.empty())
+				retired_functions_.clear();
+		}
+
+		// Marks a call in progress for as long as it lives.
+		class call_scope
+		{
+		public:
+			explicit call_scope(bean_state& state) : state_(state)
+			{
+				state_.enter_call();
+			}
+
+			call_scope(const call_scope&) = delete;
+			call_scope& operator=(const call_scope&) = delete;
+
+			~call_scope()
 			{
-				if (fun.first == name)
-					return fun.second;
+				state_.leave_call();
 			}
 
-			return nullptr;
+		private:
+			bean_state& state_;
+		};
+
+		// Where bytecode returns to when a script function it called finishes.
+		struct call_frame
+		{
+			const bytecode_program* program;
+			std::uint32_t return_pc;
+		};
+
+		variable_table variables;
+		bean_values parameter_stack;
+
+		// Operand stack and call frames of the bytecode interpreter, kept between runs so they are allocated
+		// once. Values at value_top and above are undefined.
+		bean_values value_stack;
+		std::size_t value_top = 0;
+		std::vector<call_frame> call_frames;
+
+	private:
+		// The lookup behind a cache miss, kept out of the call sites find_function is inlined into.
+		BEAN_NOINLINE bean_function* cache_function(const std::uint32_t slot, const std::string_view name)
+		{
+			if (slot >= call_cache_.size())
+				call_cache_.resize(std::size_t(slot) + 1);
+
+			const auto found = functions_.find(name);
+
+			call_cache_[slot] = { functions_version_, found != functions_.end() ? found->second.get() : nullptr };
+			return call_cache_[slot].target;
 		}
 
-		std::map<std::string, std::shared_ptr<bean_object>> variables;
-		std::map<std::string, std::shared_ptr<bean_function>> functions;
-		std::vector<std::shared_ptr<bean_object>> parameter_stack;
+		struct cached_call
+		{
+			std::uint64_t version = ~0ull;
+			bean_function* target = nullptr;
+		};
+
+		function_map functions_;
+		std::uint64_t functions_version_ = 0;
+		std::vector<cached_call> call_cache_;
+		std::uint32_t call_depth_ = 0;
+		std::vector<std::shared_ptr<bean_function>> retired_functions_;
 	};
 
-	class ast
+	// Names a compilation unit defines, and the names it uses before or without defining them. The latter
+	// are external and have to be provided by the state the unit is linked against.
+	class symbol_table
 	{
 	public:
+		void define(const std::string_view name, const symbol_kind kind)
+		{
+			defined(kind).emplace(name);
+		}
 
-		ast()
+		void reference(const std::string_view name, const symbol_kind kind)
 		{
-			children_.reserve(2);
+			if (defined(kind).count(name) == 0)
+				external(kind).emplace(name);
 		}
 
-		virtual ~ast() = default;
+		[[nodiscard]] const std::set<std::string, std::less<>>& get_defined(const symbol_kind kind) const
+		{
+			return kind == symbol_kind::variable ? variables_ : functions_;
+		}
 
-		virtual std::shared_ptr<bean_object> eval(bean_state& state)
+		[[nodiscard]] const std::set<std::string, std::less<>>& get_external(const symbol_kind kind) const
 		{
-			throw std::exception("not implemented");
+			return kind == symbol_kind::variable ? external_variables_ : external_functions_;
+		}
+
+		// Throws if state lacks a variable or function the unit depends on.
+		void link(const bean_state& state) const
+		{
+			for (const auto& name : external_variables_)
+			{
+				if (state.variables.count(name) == 0)
+				{
+					std::stringstream error;
+					error << "Unknown variable " << name << ".";
+
+					throw std::exception(error.str().c_str());
+				}
+			}
+
+			for (const auto& name : external_functions_)
+			{
+				if (state.get_functions().count(name) == 0)
+				{
+					std::stringstream error;
+					error << "Invalid token " << name << ". Suspected function name!";
+
+					throw std::exception(error.str().c_str());
+				}
+			}
+		}
+
+	private:
+		std::set<std::string, std::less<>>& defined(const symbol_kind kind)
+		{
+			return kind == symbol_kind::variable ? variables_ : functions_;
 		}
 
-		void set_left(const std::shared_ptr<ast> left)
+		std::set<std::string, std::less<>>& external(const symbol_kind kind)
 		{
-			if (children_.empty())
-				children_.resize(1);
+			return kind == symbol_kind::variable ? external_variables_ : external_functions_;
+		}
+
+		std::set<std::string, std::less<>> variables_;
+		std::set<std::string, std::less<>> functions_;
+		std::set<std::string, std::less<>> external_variables_;
+		std::set<std::string, std::less<>> external_functions_;
+	};
 
-			children_[0] = left;
+	// Nodes live in the arena of the script they were parsed from. Child lists and identifiers point into the
+	// same arena, so walking the tree never touches a reference count.
+	class ast
+	{
+	public:
+		virtual ~ast() = default;
+
+		virtual bean_value eval(bean_state& state)
+		{
+			throw std::exception("not implemented");
 		}
 
-		void set_right(const std::shared_ptr<ast> right)
+		void set_left(ast* left)
 		{
-			if (children_.size() < 2)
-				children_.resize(2);
+			operands_[0] = left;
+			children_ = arena_array<ast*>(operands_, std::max<std::size_t>(children_.size(), 1));
+		}
 
-			children_[1] = right;
+		void set_right(ast* right)
+		{
+			operands_[1] = right;
+			children_ = arena_array<ast*>(operands_, 2);
 		}
 
-		void set_children(const std::vector<std::shared_ptr<ast>> children)
+		void set_children(const arena_array<ast*> children)
 		{
 			children_ = children;
 		}
 
-		[[nodiscard]] std::vector<std::shared_ptr<ast>>& get_children()
+		[[nodiscard]] arena_array<ast*> get_children() const
 		{
 			return children_;
 		}
 
-		bool has_left()
+		bool has_left() const
 		{
 			return children_.size() >= 1;
 		}
 
-		bool has_right()
+		bool has_right() const
 		{
 			return children_.size() >= 2;
 		}
 
-		[[nodiscard]] std::shared_ptr<ast> get_left() const
+		[[nodiscard]] ast* get_left() const
 		{
 			return children_[0];
 		}
 
-		[[nodiscard]] std::shared_ptr<ast> get_right() const
+		[[nodiscard]] ast* get_right() const
 		{
 			return children_[1];
 		}
 
-		void set_identifier(const std::string& identifier)
+		// The identifier must outlive the node, usually it is interned into the script's arena.
+		void set_identifier(const std::string_view identifier)
 		{
 			identifier_ = identifier;
 		}
 
-		[[nodiscard]] std::string get_identifier() const
+		[[nodiscard]] std::string_view get_identifier() const
 		{
 			return identifier_;
 		}
 
+		// Variable slot of the identifier, for nodes that name a variable.
+		void set_slot(const std::uint32_t slot)
+		{
+			slot_ = slot;
+		}
+
+		[[nodiscard]] std::uint32_t get_slot() const
+		{
+			return slot_;
+		}
+
 		virtual std::string to_string() = 0;
 
+		[[nodiscard]] virtual flat_node_kind kind() const = 0;
+
 	protected:
-		std::vector<std::shared_ptr<ast>> children_;
-		std::string identifier_;
+		ast* operands_[2] = {};
+		arena_array<ast*> children_;
+		std::string_view identifier_;
+		std::uint32_t slot_ = variable_slots::invalid;
 	};
 
 	class ast_value_double final : public ast
 	{
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+	public:
+		explicit ast_value_double(bean_value constant) : constant_(std::move(constant))
 		{
-			double doubleValue;
 
-			// TODO: Change to a proper str -> number conversion.
-			std::stringstream stream;
-			stream << identifier_;
-			stream >> doubleValue;
-			return std::make_shared<bean_object_double>(doubleValue);
+		}
+
+		[[nodiscard]] const bean_value& get_constant() const
+		{
+			return constant_;
+		}
+
+		virtual bean_value eval(bean_state& state) override
+		{
+			return constant_;
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::floating;
 		}
 
 		virtual std::string to_string() override
@@ -221,28 +671,43 @@ namespace bean {
 			stream << "Double = " << std::setprecision(4) << identifier_;
 			return stream.str();
 		}
+
+	private:
+		bean_value constant_;
 	};
 
 	class ast_value_integer final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		explicit ast_value_integer(bean_value constant) : constant_(std::move(constant))
 		{
-			std::int32_t intValue;
 
-			// TODO: Change to a proper str -> number conversion.
-			std::stringstream stream;
-			stream << identifier_;
-			stream >> intValue;
-			return std::make_shared<bean_object_integer>(intValue);
+		}
+
+		[[nodiscard]] const bean_value& get_constant() const
+		{
+			return constant_;
+		}
+
+		virtual bean_value eval(bean_state& state) override
+		{
+			return constant_;
 		}
 		
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::integer;
+		}
+
 		virtual std::string to_string() override
 		{
 			std::stringstream stream;
 			stream << "Integer = " << identifier_;
 			return stream.str();
 		}
+
+	private:
+		bean_value constant_;
 	};
 
 
@@ -250,9 +715,14 @@ namespace bean {
 	class ast_plus final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
+		{
+			return get_left()->eval(state).lh_plus(get_right()->eval(state));
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
 		{
-			return get_left()->eval(state)->lh_plus(get_right()->eval(state));
+			return flat_node_kind::plus;
 		}
 
 		virtual std::string to_string() override
@@ -266,9 +736,14 @@ namespace bean {
 	class ast_minus final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
-			return get_left()->eval(state)->lh_minus(get_right()->eval(state));
+			return get_left()->eval(state).lh_minus(get_right()->eval(state));
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::minus;
 		}
 
 		virtual std::string to_string() override
@@ -282,9 +757,14 @@ namespace bean {
 	class ast_pow final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
+		{
+			return get_left()->eval(state).lh_pow(get_right()->eval(state));
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
 		{
-			return get_left()->eval(state)->lh_pow(get_right()->eval(state));
+			return flat_node_kind::pow;
 		}
 
 		virtual std::string to_string() override
@@ -298,9 +778,14 @@ namespace bean {
 	class ast_multiply final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
+		{
+			return get_left()->eval(state).lh_multiply(get_right()->eval(state));
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
 		{
-			return get_left()->eval(state)->lh_multiply(get_right()->eval(state));
+			return flat_node_kind::multiply;
 		}
 
 		virtual std::string to_string() override
@@ -314,9 +799,14 @@ namespace bean {
 	class ast_divide final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
+		{
+			return get_left()->eval(state).lh_divide(get_right()->eval(state));
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
 		{
-			return get_left()->eval(state)->lh_divide(get_right()->eval(state));
+			return flat_node_kind::divide;
 		}
 
 		virtual std::string to_string() override
@@ -330,13 +820,16 @@ namespace bean {
 	class ast_define_var final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
-			const auto varName = identifier_;
+			state.variables.set(slot_, bean_value::none());
 
-			state.variables[varName] = std::make_shared<bean_object>(BeanObjectType::None);
+			return bean_value::none();
+		}
 
-			return std::make_shared<bean_object>(BeanObjectType::None);
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::define_var;
 		}
 
 		virtual std::string to_string() override
@@ -350,11 +843,19 @@ namespace bean {
 	class ast_variable_reference final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
-			const auto variableName = identifier_;
+			const auto* found = state.variables.find(slot_);
+
+			if (!found)
+				throw std::exception("Unknown variable!");
+
+			return *found;
+		}
 
-			return state.variables[variableName];
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::variable_reference;
 		}
 
 		virtual std::string to_string() override
@@ -367,11 +868,16 @@ namespace bean {
 
 	class ast_return final : public ast
 	{
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
 			return get_left()->eval(state);
 		}
 
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::ret;
+		}
+
 		virtual std::string to_string() override
 		{
 			std::stringstream stream;
@@ -383,13 +889,16 @@ namespace bean {
 	class ast_define_and_set_var final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
-			const auto varName = identifier_;
+			state.variables.set(slot_, get_left()->eval(state));
 
-			state.variables[varName] = get_left()->eval(state);
+			return bean_value::none();
+		}
 
-			return std::make_shared<bean_object>(BeanObjectType::None);
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::define_and_set_var;
 		}
 
 		virtual std::string to_string() override
@@ -403,16 +912,20 @@ namespace bean {
 	class ast_set_var final : public ast
 	{
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
-			const auto varName = identifier_;
-
-			if (state.variables.count(varName) == 0)
+			if (!state.variables.find(slot_))
 				throw std::exception("Invalid variable name!");
 
-			state.variables[varName] = get_right()->eval(state);
+			// The value may define variables, which can move the table.
+			state.variables.set(slot_, get_right()->eval(state));
 
-			return std::make_shared<bean_object>(BeanObjectType::None);
+			return bean_value::none();
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::set_var;
 		}
 
 		virtual std::string to_string() override
@@ -425,17 +938,34 @@ namespace bean {
 
 	class ast_function final : public ast {
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		explicit ast_function(arena& owner) : owner_(&owner)
 		{
-			const auto function_name = identifier_;
 
-			auto new_function = std::make_shared<bean_function>(function_name);
+		}
+
+		// A body parsed into another arena is owned by the arena of the script that took it.
+		void set_owner(arena& owner)
+		{
+			owner_ = &owner;
+		}
+
+		virtual bean_value eval(bean_state& state) override
+		{
+			const std::string function_name(identifier_);
+
+			auto new_function = std::make_shared<bean_function>(function_name);
 
-			new_function->set_ast(get_left());
+			// The body shares ownership of the whole arena, so the function outlives the script defining it.
+			new_function->set_ast(std::shared_ptr<ast>(owner_->shared_from_this(), get_left()));
 
-			state.functions[function_name] = new_function;
+			state.set_function(function_name, std::move(new_function));
 
-			return std::make_shared<bean_object>(BeanObjectType::None);
+			return bean_value::none();
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::function;
 		}
 
 		virtual std::string to_string() override
@@ -444,36 +974,62 @@ namespace bean {
 			stream << "define function " << identifier_;
 			return stream.str();
 		}
+
+	private:
+		arena* owner_;
 	};
 
-	class ast_function_script_call final : public ast {
+	// Function whose body has not been parsed, only the range of its tokens is known.
+	class ast_lazy_function final : public ast {
 	public:
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		ast_lazy_function(std::shared_ptr<const token_stream> tokens, const std::uint32_t first, const std::uint32_t last) : tokens_(std::move(tokens)), first_(first), last_(last)
 		{
-			const auto function_name = identifier_;
-			const auto target_function = state.get_function(function_name);
 
-			if (target_function->get_ast())
-			{
-				return target_function->get_ast()->eval(state);
-			}
-			else
-			{
-				state.parameter_stack.clear();
+		}
 
-				for (auto& arg : this->get_children())
-				{
-					state.parameter_stack.push_back(arg->eval(state));
-				}
+		// The tree evaluator parses the body when the definition runs, flat code waits for the first call.
+		virtual bean_value eval(bean_state& state) override;
 
-				auto return_value = target_function->get_caller()(state);
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::lazy_function;
+		}
 
-				state.parameter_stack.clear();
+		virtual std::string to_string() override
+		{
+			std::stringstream stream;
+			stream << "define function " << identifier_;
+			return stream.str();
+		}
 
-				return return_value;
-			}
+		[[nodiscard]] const std::shared_ptr<const token_stream>& get_tokens() const
+		{
+			return tokens_;
+		}
+
+		[[nodiscard]] std::uint32_t get_first() const
+		{
+			return first_;
+		}
+
+		[[nodiscard]] std::uint32_t get_last() const
+		{
+			return last_;
+		}
 
-			throw std::exception("Unsure what to do when calling function!");
+	private:
+		std::shared_ptr<const token_stream> tokens_;
+		std::uint32_t first_;
+		std::uint32_t last_;
+	};
+
+	class ast_function_script_call final : public ast {
+	public:
+		virtual bean_value eval(bean_state& state) override;
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::call;
 		}
 
 		virtual std::string to_string() override
@@ -486,7 +1042,7 @@ namespace bean {
 
 	class ast_statement_list final : public ast
 	{
-		virtual std::shared_ptr<bean_object> eval(bean_state& state) override
+		virtual bean_value eval(bean_state& state) override
 		{
 			for (auto it = children_.begin(); it != children_.end(); ++it)
 			{
@@ -496,7 +1052,12 @@ namespace bean {
 					return res;
 			}
 
-			return std::make_shared<bean_object_none>();
+			return bean_value::none();
+		}
+
+		[[nodiscard]] virtual flat_node_kind kind() const override
+		{
+			return flat_node_kind::statement_list;
 		}
 
 		virtual std::string to_string() override
@@ -507,305 +1068,1209 @@ namespace bean {
 		}
 	};
 
-	inline std::shared_ptr<ast> ast_builder::parse(const token_array& tokens, bean_state& state)
+	// Precedence climbing parser. Walks a single token_stream by index, skipping whitespace, and builds the
+	// ast in one pass without copying or rescanning tokens.
+	// Assigns the name_slots of the nodes one parse creates, remembering every slot it looked up. A deferred
+	// resolver takes no lock at all and keeps the nodes until the thread that collects the parse assigns them.
+	class slot_resolver
 	{
-		token_iterator iterator(tokens);
+	public:
+		explicit slot_resolver(const bool deferred = false) : deferred_(deferred)
+		{
 
-		remove_first_last_token(iterator, token_type::lparen, token_type::rparen);
-		remove_first_last_token(iterator, token_type::lbrace, token_type::rbrace);
+		}
 
+		void assign(ast* node, const symbol_kind kind)
+		{
+			if (deferred_)
+				pending_.emplace_back(node, kind);
+			else
+				node->set_slot(resolve(node->get_identifier(), kind));
+		}
 
-		std::vector<std::shared_ptr<ast>> ast_list;
-		ast_list.reserve(1);
-		std::uint32_t last_expresssion_end = 0;
+		// Assigns the slots deferred left pending.
+		void assign_pending(slot_resolver& deferred)
+		{
+			for (const auto& [node, kind] : deferred.pending_)
+				node->set_slot(resolve(node->get_identifier(), kind));
 
-		std::shared_ptr<ast> resulting_ast;
+			deferred.pending_.clear();
+		}
 
-		while (iterator.next().is_valid())
+	private:
+		std::uint32_t resolve(const std::string_view name, const symbol_kind kind)
 		{
-			auto details = iterator.here_details();
-			auto& token = std::get<0>(details);
-			auto& token_type = std::get<1>(details);
-			auto& token_text = std::get<2>(details);
+			auto& known = kind == symbol_kind::variable ? variables_ : functions_;
+			const auto found = known.find(name);
 
-			switch (token_type)
+			if (found != known.end())
+				return found->second;
+
+			const auto slot = kind == symbol_kind::variable ? variable_slots::resolve(name) : function_slots::resolve(name);
+			known.emplace(name, slot);
+			return slot;
+		}
+
+		bool deferred_;
+		std::vector<std::pair<ast*, symbol_kind>> pending_;
+		std::unordered_map<std::string_view, std::uint32_t> variables_;
+		std::unordered_map<std::string_view, std::uint32_t> functions_;
+	};
+
+	class ast_parser
+	{
+	public:
+		ast_parser(const token_stream& tokens, symbol_table& symbols, constant_pool& constants, arena& nodes) : ast_parser(tokens, symbols, constants, nodes, nullptr, 0, tokens.size())
+		{
+
+		}
+
+		// Parses [first, last) of tokens. Function bodies are left unparsed when lazy_tokens, the stream
+		// tokens belongs to, is given.
+		ast_parser(const token_stream& tokens, symbol_table& symbols, constant_pool& constants, arena& nodes, std::shared_ptr<const token_stream> lazy_tokens, const std::size_t first, const std::size_t last)
+			: tokens_(tokens), symbols_(symbols), constants_(constants), nodes_(nodes), lazy_tokens_(std::move(lazy_tokens)), index_(first), end_(std::min(last, tokens.size()))
+		{
+			skip_whitespace();
+		}
+
+		// A function body parsed ahead of the script that defines it, with everything the parse produced.
+		struct parsed_body
+		{
+			std::size_t open = 0;
+			std::size_t close = 0;
+			ast* root = nullptr;
+			symbol_table symbols;
+			// Slots are assigned by the script parser, workers do not touch the registry.
+			slot_resolver slots{ true };
+			// Shared by the bodies parsed in one batch.
+			std::shared_ptr<arena> nodes;
+			std::exception_ptr error;
+		};
+
+		// Finds the bodies of top-level functions through the bracket match table and parses each of them on
+		// pool. Errors are kept with their body and thrown when the script parse reaches it.
+		static std::vector<parsed_body> parse_function_bodies(const token_stream& tokens, thread_pool& pool)
+		{
+			std::vector<parsed_body> bodies;
+
+			const auto next_token = [&tokens](std::size_t index)
 			{
-			case token_type::symbol:
+				while (index < tokens.size() && (tokens.get_type(index) == token_type::space || tokens.get_type(index) == token_type::carriagereturn))
+					index++;
+
+				return index;
+			};
+
+			for (std::size_t i = 0; i < tokens.size(); i++)
 			{
-				if (token_text == "fun")
+				const auto type = tokens.get_type(i);
+
+				if (type == token_type::kw_fun)
 				{
-					details = iterator.next_details();
+					const auto name = next_token(i + 1);
+					const auto open = next_token(name + 1);
 
-					if (token_type != token_type::symbol)
+					if (name < tokens.size() && tokens.get_type(name) == token_type::symbol && open < tokens.size() && tokens.get_type(open) == token_type::lbrace)
 					{
-						throw std::exception("Expected name proceeding 'fun' token.");
-					}
+						const auto close = tokens.get_match(open);
 
-					const auto function_name = token_text;  // NOLINT(performance-unnecessary-copy-initialization)
+						if (close == invalid_token_index)
+							break;
 
-					details = iterator.next_details();
+						bodies.emplace_back();
+						bodies.back().open = open;
+						bodies.back().close = close;
 
-					if (token_type != token_type::lbrace)
-					{
-						throw std::exception("Expected body proceeding function name.");
+						i = close;
 					}
+				}
+				else if (type == token_type::lbrace || type == token_type::lparen)
+				{
+					// Anything inside other brackets is not at the top level.
+					const auto close = tokens.get_match(i);
 
-					resulting_ast = std::make_shared<ast_function>();
-					resulting_ast->set_identifier(function_name);
+					if (close == invalid_token_index)
+						break;
 
+					i = close;
+				}
+			}
 
+			// Not worth handing out, the script parser takes them in line.
+			if (bodies.size() < 2 || pool.size() == 1)
+				return {};
 
-					iterator.before();
-					// +1 to skip over name
-					auto body_end = iterator.find_last_pos_of_open_close(token_type::lbrace, token_type::rbrace) + 1;
-					auto function_body = iterator.splice(iterator.get_index() + 1, body_end);
-					iterator.next();
+			// Bodies are handed out in batches, an arena per function would cost more than most bodies take to parse.
+			const auto batches = std::min(bodies.size(), pool.size() * 4);
 
-					state.functions[function_name] = nullptr;
+			pool.parallel_for(batches, [&tokens, &bodies, batches](const std::size_t batch)
+			{
+				const auto nodes = arena::create();
 
-					resulting_ast->set_left(parse(function_body.get_tokens(), state));
-					ast_list.push_back(resulting_ast);
+				// Literals are boxed again in the script's own pool when the bodies are taken.
+				constant_pool constants;
 
-					// jump iterator till the end of block.
-					iterator.jump_to(body_end - 1);
-					last_expresssion_end = body_end;
-				}
-				else if (token_text == "var")
+				for (auto index = bodies.size() * batch / batches; index < bodies.size() * (batch + 1) / batches; index++)
 				{
-					details = iterator.next_details();
+					auto& body = bodies[index];
+					body.nodes = nodes;
 
-					if (token_type != token_type::symbol)
+					try
+					{
+						ast_parser parser(tokens, body.symbols, constants, *nodes, nullptr, body.open + 1, body.close);
+						parser.slots_ = &body.slots;
+						body.root = parser.parse_program();
+					}
+					catch (...)
 					{
-						throw std::exception("Expected name proceeding 'var' token.");
+						body.error = std::current_exception();
 					}
+				}
+			});
 
-					const auto var_name = token_text;  // NOLINT(performance-unnecessary-copy-initialization)
+			return bodies;
+		}
 
-					details = iterator.next_details();
+		// Function bodies starting at the open brace of a parsed_body are taken from bodies instead of parsed.
+		void use_parsed_bodies(std::vector<parsed_body>& bodies)
+		{
+			parsed_bodies_ = &bodies;
+			next_body_ = 0;
+		}
 
-					if (token_type != token_type::equal)
-					{
-						throw std::exception("Expected equal token proceeding variable token.");
-					}
+		ast* parse_program()
+		{
+			auto program = parse_statements(token_type::invalid);
 
-					details = iterator.next_details();
+			if (peek() != token_type::invalid)
+			{
+				throw std::exception("Unexpected token after end of script.");
+			}
 
-					auto assignment_body_end = iterator.find_first_of(token_type::semicolon);
-					auto assignment_body = iterator.splice(iterator.get_index(), assignment_body_end);
+			return program;
+		}
 
+	private:
+		// Binding power of a binary operator, 0 for tokens that do not continue an expression.
+		static int precedence(const token_type type)
+		{
+			switch (type)
+			{
+			case token_type::equal:
+				return 1;
+			case token_type::plus:
+			case token_type::minus:
+				return 2;
+			case token_type::asterisk:
+			case token_type::forward_slash:
+				return 3;
+			case token_type::carrot:
+			case token_type::pow:
+				return 4;
+			default:
+				return 0;
+			}
+		}
 
-					resulting_ast = std::make_shared<ast_define_and_set_var>();
+		token_type peek() const
+		{
+			return index_ < end_ ? tokens_.get_type(index_) : token_type::invalid;
+		}
 
-					state.variables[var_name] = std::make_shared<bean_object_none>();
+		void skip_whitespace()
+		{
+			while (index_ < end_ && (tokens_.get_type(index_) == token_type::space || tokens_.get_type(index_) == token_type::carriagereturn))
+				index_++;
+		}
 
-					resulting_ast->set_identifier(var_name);
-					resulting_ast->set_left(parse(assignment_body.get_tokens(), state));
-					ast_list.push_back(resulting_ast);
+		void advance()
+		{
+			index_++;
+			skip_whitespace();
+		}
 
-					// jump iterator till end of block.
-					iterator.jump_to(assignment_body_end - 1);
-					last_expresssion_end = assignment_body_end;
-				}
-				else if (token_text == "return")
+		std::string_view expect(const token_type type, const char* error)
+		{
+			if (peek() != type)
+			{
+				throw std::exception(error);
+			}
+
+			const auto text = nodes_.intern(tokens_.get_text(index_));
+			advance();
+			return text;
+		}
+
+		// Points the identifiers of a tree parsed into another arena at the strings interned here, hands the
+		// functions it defines to this arena and adds its literals to this script's constants, in the order a
+		// serial parse would have.
+		void take_tree(ast* node)
+		{
+			if (node == nullptr)
+				return;
+
+			node->set_identifier(nodes_.intern(node->get_identifier()));
+
+			if (node->kind() == flat_node_kind::function)
+				static_cast<ast_function*>(node)->set_owner(nodes_);
+
+			if (node->kind() == flat_node_kind::integer)
+				constants_.get_integer(static_cast<ast_value_integer*>(node)->get_constant().as_int());
+			else if (node->kind() == flat_node_kind::floating)
+				constants_.get_double(static_cast<ast_value_double*>(node)->get_constant().as_double());
+
+			for (auto* child : node->get_children())
+				take_tree(child);
+		}
+
+		// Statements up to the close token, which is left for the caller to consume.
+		ast* parse_statements(const token_type close)
+		{
+			std::vector<ast*> statements;
+
+			while (peek() != close && peek() != token_type::invalid)
+			{
+				if (peek() == token_type::semicolon)
 				{
-					details = iterator.next_details();
+					advance();
+					continue;
+				}
+
+				statements.push_back(parse_statement());
+			}
+
+			if (statements.empty())
+			{
+				throw std::exception("Failed to parse statement!");
+			}
+
+			if (statements.size() == 1)
+				return statements[0];
+
+			auto* list = nodes_.create<ast_statement_list>();
+			list->set_children(nodes_.copy_array(statements));
+			return list;
+		}
+
+		ast* parse_statement()
+		{
+			ast* statement;
+
+			switch (peek())
+			{
+			case token_type::kw_fun:
+			{
+				advance();
+
+				const auto function_name = expect(token_type::symbol, "Expected name proceeding 'fun' token.");
+
+				const auto body_start = index_;
+
+				expect(token_type::lbrace, "Expected body proceeding function name.");
+
+				// Defined before the body is parsed so the function can call itself.
+				symbols_.define(function_name, symbol_kind::function);
 
-					auto return_body_end = iterator.find_first_of(token_type::semicolon);
+				if (lazy_tokens_)
+				{
+					const auto body_end = tokens_.get_match(body_start);
 
-					if (return_body_end == invalid_token_index)
-						return_body_end = iterator.size();
+					if (body_end == invalid_token_index || body_end >= end_)
+					{
+						throw std::exception("Expected '}' to close function body.");
+					}
 
-					auto return_body = iterator.splice(iterator.get_index(), return_body_end);
+					statement = nodes_.create<ast_lazy_function>(lazy_tokens_, std::uint32_t(body_start + 1), body_end);
+					statement->set_identifier(function_name);
 
-					resulting_ast = std::make_shared<ast_return>();
-					resulting_ast->set_left(parse(return_body.get_tokens(), state));
-					ast_list.push_back(resulting_ast);
+					index_ = body_end;
+					advance();
 
-					// jump iterator till end of block.
-					iterator.jump_to(return_body_end - 1);
-					last_expresssion_end = return_body_end;
+					return statement;
 				}
-				else if (iterator.size() > 1)
+
+				statement = nodes_.create<ast_function>(nodes_);
+				statement->set_identifier(function_name);
+
+				if (parsed_bodies_ && next_body_ < parsed_bodies_->size() && (*parsed_bodies_)[next_body_].open == body_start)
 				{
-					const auto token_index = iterator.find_rightmost_of_pemdas();
+					auto& body = (*parsed_bodies_)[next_body_++];
+
+					if (body.error)
+						std::rethrow_exception(body.error);
 
-					if (token_index == invalid_token_index)
+					// Replayed as if the body had been parsed here, externals first.
+					for (const auto kind : { symbol_kind::variable, symbol_kind::function })
 					{
-						throw std::exception("No token found to parse expression!");
+						for (const auto& name : body.symbols.get_external(kind))
+							symbols_.reference(name, kind);
+
+						for (const auto& name : body.symbols.get_defined(kind))
+							symbols_.define(name, kind);
 					}
 
-					iterator.jump_to(token_index);
+					slots_->assign_pending(body.slots);
 
-					details = iterator.here_details();
+					if (body.nodes != adopted_)
+					{
+						nodes_.adopt(body.nodes);
+						adopted_ = body.nodes;
+					}
 
-					// Parse mathematical expression
-					if (token_type != token_type::symbol) {
+					take_tree(body.root);
 
-						switch (token_type)
-						{
-						case token_type::plus:
-							resulting_ast = std::make_shared<ast_plus>();
-							break;
-						case token_type::minus:
-							resulting_ast = std::make_shared<ast_minus>();
-							break;
-						case token_type::asterisk:
-							resulting_ast = std::make_shared<ast_multiply>();
-							break;
-						case token_type::forward_slash:
-							resulting_ast = std::make_shared<ast_divide>();
-							break;
-						case token_type::carrot:
-							resulting_ast = std::make_shared<ast_pow>();
-							break;
-						case token_type::equal:
-							resulting_ast = std::make_shared<ast_set_var>();
-							break;
-						default:
-							throw std::exception("No handler for mathematical token.");
-							break;
-						}
+					statement->set_left(body.root);
 
+					index_ = body.close;
+					advance();
 
-						auto expression_end = iterator.find_first_of(token_type::semicolon);
+					return statement;
+				}
 
-						if (expression_end == invalid_token_index)
-							expression_end = iterator.size();
+				statement->set_left(parse_statements(token_type::rbrace));
 
-						auto expression_left = iterator.splice(last_expresssion_end, iterator.get_index());
-						auto expression_right = iterator.splice(iterator.get_index() + 1, expression_end);
+				expect(token_type::rbrace, "Expected '}' to close function body.");
 
+				// A function body is closed by its brace, no terminator needed.
+				return statement;
+			}
+			case token_type::kw_var:
+			{
+				advance();
 
-						resulting_ast->set_left(parse(expression_left.get_tokens(), state));
-						resulting_ast->set_right(parse(expression_right.get_tokens(), state));
-						ast_list.push_back(resulting_ast);
+				const auto var_name = expect(token_type::symbol, "Expected name proceeding 'var' token.");
 
-						// jump iterator till end of block.
-						iterator.jump_to(expression_end - 1);
-						last_expresssion_end = expression_end;
+				expect(token_type::equal, "Expected equal token proceeding variable token.");
 
-					}
-					else
-					{
-						// Some expression that contains no mathematical operators but has more than one symbol.
+				statement = nodes_.create<ast_define_and_set_var>();
+				statement->set_identifier(var_name);
+				slots_->assign(statement, symbol_kind::variable);
+				statement->set_left(parse_expression(1));
 
-						if (state.functions.count(token_text))
-						{
-							// Possible function call.
-							details = iterator.next_details();
+				// Defined after its value, which can not refer to the variable being created.
+				symbols_.define(var_name, symbol_kind::variable);
+			}
+			break;
+			case token_type::kw_return:
+			{
+				advance();
 
-							if (token_type == token_type::lparen)
-							{
-								// go back to function name to capture it
-								iterator.before();
-								details = iterator.here_details();
+				statement = nodes_.create<ast_return>();
+				statement->set_left(parse_expression(1));
+			}
+			break;
+			default:
+				statement = parse_expression(1);
+				break;
+			}
 
-								// Function call.
-								const auto function_name = token_text;  // NOLINT(performance-unnecessary-copy-initialization)
+			switch (peek())
+			{
+			case token_type::semicolon:
+				advance();
+				break;
+			case token_type::rbrace:
+			case token_type::invalid:
+				break;
+			default:
+				throw std::exception("Expected ';' after statement.");
+			}
 
-								auto parameter_body_end = iterator.find_last_pos_of_open_close(token_type::lparen, token_type::rparen);
-								auto parameter_body = iterator.splice(iterator.get_index() + 2, parameter_body_end);
+			return statement;
+		}
 
-								std::vector<token_iterator> parameter_iterators;
+		ast* parse_expression(const int min_precedence)
+		{
+			auto* left = parse_primary();
 
-								if (!parameter_body.empty())
-								{
-									// We have parameters!
-									/* TODO: Implement don't peak for split as to allow something like print(some_func(arg1, arg2))*/
-									parameter_iterators = parameter_body.split(token_type::comma);
-								}
+			for (auto type = peek(); precedence(type) >= min_precedence && precedence(type) > 0; type = peek())
+			{
+				advance();
 
+				// Assignment is right associative, every other operator is left associative.
+				auto* right = parse_expression(type == token_type::equal ? precedence(type) : precedence(type) + 1);
 
-								resulting_ast = std::make_shared<ast_function_script_call>();
-								resulting_ast->set_identifier(function_name);
+				left = make_binary(type, left, right);
+			}
 
-								for (auto& param_iter : parameter_iterators)
-								{
-									auto param = parse(param_iter.get_tokens(), state);
+			return left;
+		}
 
-									resulting_ast->get_children().push_back(std::move(param));
-								}
+		ast* make_binary(const token_type type, ast* left, ast* right)
+		{
+			ast* node;
 
-								ast_list.push_back(resulting_ast);
+			switch (type)
+			{
+			case token_type::plus:
+				node = nodes_.create<ast_plus>();
+				break;
+			case token_type::minus:
+				node = nodes_.create<ast_minus>();
+				break;
+			case token_type::asterisk:
+				node = nodes_.create<ast_multiply>();
+				break;
+			case token_type::forward_slash:
+				node = nodes_.create<ast_divide>();
+				break;
+			case token_type::carrot:
+			case token_type::pow:
+				node = nodes_.create<ast_pow>();
+				break;
+			case token_type::equal:
+				if (!dynamic_cast<ast_variable_reference*>(left))
+				{
+					throw std::exception("Expected variable on left hand side of assignment.");
+				}
 
-								iterator.jump_to(parameter_body_end - 1);
-								last_expresssion_end = parameter_body_end;
-							}
+				node = nodes_.create<ast_set_var>();
+				node->set_identifier(left->get_identifier());
+				slots_->assign(node, symbol_kind::variable);
+				break;
+			default:
+				throw std::exception("No handler for mathematical token.");
+			}
 
-						}
-						else
-						{
-							std::stringstream error;
-							error << "Invalid token " << token_text << ". Suspected function name!";
+			node->set_left(left);
+			node->set_right(right);
+			return node;
+		}
 
-							throw std::exception(error.str().c_str());
-						}
+		ast* parse_primary()
+		{
+			ast* node;
 
-					}
+			switch (peek())
+			{
+			case token_type::integer_literal:
+				node = nodes_.create<ast_value_integer>(constants_.get_integer(tokens_.get_value(index_).integer));
+				node->set_identifier(nodes_.intern(tokens_.get_text(index_)));
+				advance();
+				break;
+			case token_type::double_literal:
+				node = nodes_.create<ast_value_double>(constants_.get_double(tokens_.get_value(index_).floating));
+				node->set_identifier(nodes_.intern(tokens_.get_text(index_)));
+				advance();
+				break;
+			case token_type::lparen:
+				advance();
+				node = parse_expression(1);
+				expect(token_type::rparen, "Expected ')' to close expression.");
+				break;
+			case token_type::symbol:
+			{
+				const auto name = nodes_.intern(tokens_.get_text(index_));
+				advance();
+
+				double number;
+
+				if (peek() == token_type::lparen)
+				{
+					node = parse_call(name);
+				}
+				else if (peek() != token_type::equal && tokenizer::read_number_word(name, number))
+				{
+					node = nodes_.create<ast_value_double>(constants_.get_double(number));
+					node->set_identifier(name);
 				}
-				else if (iterator.size() == 1)
+				else
 				{
-					std::shared_ptr<ast> ast_node;
+					symbols_.reference(name, symbol_kind::variable);
 
-					auto textual_representation = iterator.here().get_text();
+					node = nodes_.create<ast_variable_reference>();
+					node->set_identifier(name);
+					slots_->assign(node, symbol_kind::variable);
+				}
+			}
+			break;
+			default:
+				throw std::exception("No token found to parse expression!");
+			}
 
-					char* p = nullptr;
+			return node;
+		}
 
-					auto i = std::strtol(textual_representation.data(), &p, 10);
-					if (p == textual_representation.data() + textual_representation.size())
-					{
-						ast_node = std::make_shared<ast_value_integer>();
-					}
+		ast* parse_call(const std::string_view function_name)
+		{
+			symbols_.reference(function_name, symbol_kind::function);
 
-					if (!ast_node) {
-						auto f = std::strtod(textual_representation.data(), &p);
-						if (p == textual_representation.data() + textual_representation.size())
-						{
-							ast_node = std::make_shared<ast_value_double>();
-						}
-					}
+			advance();
 
-					if (!ast_node) {
-						if (state.variables.count(textual_representation) > 0)
-						{
-							ast_node = std::make_shared<ast_variable_reference>();
-						}
-						else
-						{
-							throw std::exception("Unable to parse single symbol.");
-						}
-					}
+			auto* call = nodes_.create<ast_function_script_call>();
+			call->set_identifier(function_name);
+			slots_->assign(call, symbol_kind::function);
 
-					if (!ast_node)
-					{
-						throw std::exception("No known type for symbol");
-					}
+			std::vector<ast*> arguments;
+
+			while (peek() != token_type::rparen)
+			{
+				arguments.push_back(parse_expression(1));
+
+				if (peek() == token_type::comma)
+					advance();
+				else if (peek() != token_type::rparen)
+					throw std::exception("Expected ',' or ')' in function call.");
+			}
 
-					ast_node->set_identifier(textual_representation);
+			advance();
+
+			call->set_children(nodes_.copy_array(arguments));
+			return call;
+		}
+
+		const token_stream& tokens_;
+		symbol_table& symbols_;
+		constant_pool& constants_;
+		arena& nodes_;
+		std::shared_ptr<const token_stream> lazy_tokens_;
+		std::size_t index_;
+		std::size_t end_;
+		std::vector<parsed_body>* parsed_bodies_ = nullptr;
+		std::size_t next_body_ = 0;
+		std::shared_ptr<arena> adopted_;
+		slot_resolver own_slots_;
+		slot_resolver* slots_ = &own_slots_;
+	};
+
+	// Flat encoding of a parsed script: one contiguous array of fixed size node records in evaluation order,
+	// children before their parents and the root last. Nodes refer to each other, to constants and to names
+	// by index only, so the whole thing can be copied or written out as plain arrays. The arrays are either
+	// owned or views into a mapped precompiled file.
+	class flat_ast : public std::enable_shared_from_this<flat_ast>
+	{
+	public:
+		static std::shared_ptr<flat_ast> flatten(ast* root, const constant_pool& constants);
 
-					return ast_node;
+		bean_value eval(bean_state& state) const
+		{
+			return eval(state, root_);
+		}
+
+		bean_value eval(bean_state& state, std::uint32_t index) const;
+
+		// Runs the body of the function defined by the node at index, parsing it first if it is lazy.
+		bean_value call(bean_state& state, std::uint32_t index) const;
+
+		// The script a lazy body compiles to, parsed on first use.
+		const compiled_script& get_lazy_script(std::uint32_t body) const;
+
+		// Function bodies that are not parsed yet. They need the token stream, so such code can not be
+		// precompiled.
+		[[nodiscard]] std::size_t lazy_count() const
+		{
+			return lazy_bodies_.size();
+		}
+
+		// Same text ast::to_string gives for the node the record was made from.
+		[[nodiscard]] std::string to_string(std::uint32_t index) const;
+
+		[[nodiscard]] std::vector<std::uint32_t> get_children(std::uint32_t index) const;
+
+		[[nodiscard]] arena_array<const flat_node> get_nodes() const
+		{
+			return nodes_;
+		}
+
+		[[nodiscard]] arena_array<const std::uint32_t> get_operands() const
+		{
+			return operands_;
+		}
+
+		[[nodiscard]] const std::vector<std::string_view>& get_names() const
+		{
+			return names_;
+		}
+
+		// Variable slot of every name a variable node uses, indexed like the names.
+		[[nodiscard]] const std::vector<std::uint32_t>& get_slots() const
+		{
+			return slots_;
+		}
+
+		// Function slot of every name a call uses, indexed like the names.
+		[[nodiscard]] const std::vector<std::uint32_t>& get_call_slots() const
+		{
+			return call_slots_;
+		}
+
+		[[nodiscard]] const bean_values& get_constants() const
+		{
+			return constants_;
+		}
+
+		[[nodiscard]] std::uint32_t get_root() const
+		{
+			return root_;
+		}
+
+	private:
+		friend class precompiled;
+
+		void bind_slot(const std::uint32_t name, const std::uint32_t slot)
+		{
+			if (name >= slots_.size())
+				slots_.resize(names_.size(), variable_slots::invalid);
+
+			slots_[name] = slot;
+		}
+
+		void bind_call_slot(const std::uint32_t name, const std::uint32_t slot)
+		{
+			if (name >= call_slots_.size())
+				call_slots_.resize(names_.size(), function_slots::invalid);
+
+			call_slots_[name] = slot;
+		}
+
+		// Resolves the slots of records that were not made from parsed nodes, once per name.
+		void resolve_slots()
+		{
+			for (const auto& node : nodes_)
+			{
+				switch (node.kind)
+				{
+				case flat_node_kind::define_var:
+				case flat_node_kind::variable_reference:
+				case flat_node_kind::define_and_set_var:
+				case flat_node_kind::set_var:
+					if (node.name >= slots_.size() || slots_[node.name] == variable_slots::invalid)
+						bind_slot(node.name, variable_slots::resolve(names_[node.name]));
+					break;
+				case flat_node_kind::call:
+					if (node.name >= call_slots_.size() || call_slots_[node.name] == function_slots::invalid)
+						bind_call_slot(node.name, function_slots::resolve(names_[node.name]));
+					break;
+				default:
+					break;
 				}
 			}
+		}
+
+		struct lazy_body
+		{
+			lazy_body(std::shared_ptr<const token_stream> tokens, const std::uint32_t first, const std::uint32_t last) : tokens(std::move(tokens)), first(first), last(last)
+			{
+
+			}
+
+			std::shared_ptr<const token_stream> tokens;
+			std::uint32_t first;
+			std::uint32_t last;
+			mutable std::once_flag parsed;
+			mutable std::shared_ptr<const compiled_script> script;
+		};
+
+		struct flattener
+		{
+			flat_ast& code;
+			const constant_pool& constants;
+			std::unordered_map<std::string_view, std::uint32_t> names;
+
+			std::uint32_t name(const std::string_view text)
+			{
+				const auto found = names.find(text);
+
+				if (found != names.end())
+					return found->second;
+
+				const auto index = std::uint32_t(code.names_.size());
+				code.names_.emplace_back(code.name_storage_.emplace_back(text));
+				names.emplace(text, index);
+				return index;
+			}
+
+			std::uint32_t emit(ast* node);
+		};
+
+		arena_array<const flat_node> nodes_;
+		arena_array<const std::uint32_t> operands_;
+		std::vector<std::string_view> names_;
+		std::vector<std::uint32_t> slots_;
+		std::vector<std::uint32_t> call_slots_;
+		bean_values constants_;
+		std::uint32_t root_ = 0;
+
+		// What the views above point into.
+		std::vector<flat_node> node_storage_;
+		std::vector<std::uint32_t> operand_storage_;
+		std::deque<std::string> name_storage_;
+		source_buffer_ptr file_;
+
+		std::deque<lazy_body> lazy_bodies_;
+	};
+
+	inline std::shared_ptr<flat_ast> flat_ast::flatten(ast* root, const constant_pool& constants)
+	{
+		auto code = std::make_shared<flat_ast>();
+		code->constants_ = constants.get_constants();
+
+		flattener builder{ *code, constants, {} };
+
+		code->root_ = builder.emit(root);
+		code->nodes_ = arena_array<const flat_node>(code->node_storage_.data(), code->node_storage_.size());
+		code->operands_ = arena_array<const std::uint32_t>(code->operand_storage_.data(), code->operand_storage_.size());
+		return code;
+	}
+
+	inline std::uint32_t flat_ast::flattener::emit(ast* node)
+	{
+		flat_node record{ node->kind(), {}, 0, 0, 0 };
+
+		switch (record.kind)
+		{
+		case flat_node_kind::integer:
+			record.left = constants.index_of(static_cast<ast_value_integer*>(node)->get_constant());
+			record.name = name(node->get_identifier());
 			break;
+		case flat_node_kind::floating:
+			record.left = constants.index_of(static_cast<ast_value_double*>(node)->get_constant());
+			record.name = name(node->get_identifier());
 			break;
-			default:
-				break;
+		case flat_node_kind::plus:
+		case flat_node_kind::minus:
+		case flat_node_kind::multiply:
+		case flat_node_kind::divide:
+		case flat_node_kind::pow:
+			record.left = emit(node->get_left());
+			record.right = emit(node->get_right());
+			break;
+		case flat_node_kind::set_var:
+			record.name = name(node->get_identifier());
+			record.left = emit(node->get_left());
+			record.right = emit(node->get_right());
+			code.bind_slot(record.name, node->get_slot());
+			break;
+		case flat_node_kind::define_var:
+		case flat_node_kind::variable_reference:
+			record.name = name(node->get_identifier());
+			code.bind_slot(record.name, node->get_slot());
+			break;
+		case flat_node_kind::ret:
+			record.left = emit(node->get_left());
+			break;
+		case flat_node_kind::define_and_set_var:
+			record.name = name(node->get_identifier());
+			record.left = emit(node->get_left());
+			code.bind_slot(record.name, node->get_slot());
+			break;
+		case flat_node_kind::function:
+			record.name = name(node->get_identifier());
+			record.left = emit(node->get_left());
+			break;
+		case flat_node_kind::lazy_function:
+		{
+			const auto* lazy = static_cast<ast_lazy_function*>(node);
+
+			record.name = name(node->get_identifier());
+			record.left = std::uint32_t(code.lazy_bodies_.size());
+			code.lazy_bodies_.emplace_back(lazy->get_tokens(), lazy->get_first(), lazy->get_last());
+		}
+		break;
+		case flat_node_kind::call:
+		case flat_node_kind::statement_list:
+		{
+			if (record.kind == flat_node_kind::call)
+			{
+				record.name = name(node->get_identifier());
+				code.bind_call_slot(record.name, node->get_slot());
 			}
 
+			std::vector<std::uint32_t> entries;
+			entries.reserve(node->get_children().size());
+
+			for (auto* child : node->get_children())
+				entries.push_back(emit(child));
+
+			record.left = std::uint32_t(code.operand_storage_.size());
+			record.right = std::uint32_t(entries.size());
+			code.operand_storage_.insert(code.operand_storage_.end(), entries.begin(), entries.end());
+		}
+		break;
+		}
+
+		code.node_storage_.push_back(record);
+		return std::uint32_t(code.node_storage_.size() - 1);
+	}
+
+	inline bean_value flat_ast::eval(bean_state& state, const std::uint32_t index) const
+	{
+		const auto& node = nodes_[index];
+
+		switch (node.kind)
+		{
+		case flat_node_kind::integer:
+		case flat_node_kind::floating:
+			return constants_[node.left];
+		case flat_node_kind::plus:
+			return eval(state, node.left).lh_plus(eval(state, node.right));
+		case flat_node_kind::minus:
+			return eval(state, node.left).lh_minus(eval(state, node.right));
+		case flat_node_kind::multiply:
+			return eval(state, node.left).lh_multiply(eval(state, node.right));
+		case flat_node_kind::divide:
+			return eval(state, node.left).lh_divide(eval(state, node.right));
+		case flat_node_kind::pow:
+			return eval(state, node.left).lh_pow(eval(state, node.right));
+		case flat_node_kind::define_var:
+			state.variables.set(slots_[node.name], bean_value::none());
+			return bean_value::none();
+		case flat_node_kind::variable_reference:
+		{
+			const auto* found = state.variables.find(slots_[node.name]);
+
+			if (!found)
+				throw std::exception("Unknown variable!");
+
+			return *found;
+		}
+		case flat_node_kind::ret:
+			return eval(state, node.left);
+		case flat_node_kind::define_and_set_var:
+		{
+			state.variables.set(slots_[node.name], eval(state, node.left));
+
+			return bean_value::none();
+		}
+		case flat_node_kind::set_var:
+		{
+			if (!state.variables.find(slots_[node.name]))
+				throw std::exception("Invalid variable name!");
+
+			state.variables.set(slots_[node.name], eval(state, node.right));
+
+			return bean_value::none();
+		}
+		case flat_node_kind::function:
+		case flat_node_kind::lazy_function:
+		{
+			const auto existing = state.get_function(names_[node.name]);
+
+			// Running a script again leaves its functions and the cached calls to them in place.
+			if (existing && existing->get_code().get() == this && existing->get_entry() == index)
+				return bean_value::none();
+
+			auto new_function = std::make_shared<bean_function>(std::string(names_[node.name]));
+
+			// Sharing ownership of the records keeps the body alive after the defining script is dropped.
+			new_function->set_code(shared_from_this(), index);
+
+			state.set_function(names_[node.name], std::move(new_function));
+
+			return bean_value::none();
+		}
+		case flat_node_kind::call:
+		{
+			auto* target_function = state.find_function(call_slots_[node.name], names_[node.name]);
+
+			if (!target_function)
+				throw std::exception("Call to an undefined function!");
+
+			const bean_state::call_scope scope(state);
+
+			if (target_function->get_code())
+				return target_function->get_code()->call(state, target_function->get_entry());
+
+			if (target_function->get_ast())
+				return target_function->get_ast()->eval(state);
+
+			// Arguments are evaluated before the parameter stack is filled, they may be calls themselves.
+			bean_values arguments;
+			arguments.reserve(node.right);
+
+			for (std::uint32_t i = 0; i < node.right; i++)
+				arguments.push_back(eval(state, operands_[node.left + i]));
+
+			state.parameter_stack = std::move(arguments);
+
+			auto return_value = target_function->get_caller()(state);
+
+			state.parameter_stack.clear();
+
+			return return_value;
+		}
+		case flat_node_kind::statement_list:
+		{
+			bean_value result;
+
+			for (std::uint32_t i = 0; i < node.right; i++)
+				result = eval(state, operands_[node.left + i]);
+
+			return result ? result : bean_value::none();
+		}
+		}
+
+		throw std::exception("Unknown flat node kind!");
+	}
+
+	inline std::string flat_ast::to_string(const std::uint32_t index) const
+	{
+		const auto& node = nodes_[index];
+
+		std::stringstream stream;
+
+		switch (node.kind)
+		{
+		case flat_node_kind::integer:
+			stream << "Integer = " << names_[node.name];
+			break;
+		case flat_node_kind::floating:
+			stream << "Double = " << std::setprecision(4) << names_[node.name];
+			break;
+		case flat_node_kind::plus:
+			stream << "Plus";
+			break;
+		case flat_node_kind::minus:
+			stream << "Minus";
+			break;
+		case flat_node_kind::multiply:
+			stream << "Multiply";
+			break;
+		case flat_node_kind::divide:
+			stream << "Divide";
+			break;
+		case flat_node_kind::pow:
+			stream << "Exponent";
+			break;
+		case flat_node_kind::define_var:
+			stream << "var x = " << names_[node.name];
+			break;
+		case flat_node_kind::variable_reference:
+			stream << "reference to " << names_[node.name];
+			break;
+		case flat_node_kind::ret:
+			stream << "return";
+			break;
+		case flat_node_kind::define_and_set_var:
+			stream << "create and set " << names_[node.name];
+			break;
+		case flat_node_kind::set_var:
+			stream << "set " << names_[node.name];
+			break;
+		case flat_node_kind::function:
+		case flat_node_kind::lazy_function:
+			stream << "define function " << names_[node.name];
+			break;
+		case flat_node_kind::call:
+			stream << "call function " << names_[node.name];
+			break;
+		case flat_node_kind::statement_list:
+			stream << "statement list";
+			break;
+		}
+
+		return stream.str();
+	}
+
+	inline std::vector<std::uint32_t> flat_ast::get_children(const std::uint32_t index) const
+	{
+		const auto& node = nodes_[index];
+
+		switch (node.kind)
+		{
+		case flat_node_kind::plus:
+		case flat_node_kind::minus:
+		case flat_node_kind::multiply:
+		case flat_node_kind::divide:
+		case flat_node_kind::pow:
+		case flat_node_kind::set_var:
+			return { node.left, node.right };
+		case flat_node_kind::ret:
+		case flat_node_kind::define_and_set_var:
+		case flat_node_kind::function:
+			return { node.left };
+		case flat_node_kind::call:
+		case flat_node_kind::statement_list:
+			return std::vector<std::uint32_t>(operands_.begin() + node.left, operands_.begin() + node.left + node.right);
+		default:
+			return {};
+		}
+	}
+
+	inline bean_value ast_function_script_call::eval(bean_state& state)
+	{
+		auto* target_function = state.find_function(slot_, identifier_);
+
+		if (!target_function)
+			throw std::exception("Call to an undefined function!");
+
+		const bean_state::call_scope scope(state);
+
+		if (target_function->get_code())
+			return target_function->get_code()->call(state, target_function->get_entry());
+
+		if (target_function->get_ast())
+			return target_function->get_ast()->eval(state);
+
+		// Arguments are evaluated before the parameter stack is filled, they may be calls themselves.
+		bean_values arguments;
+		arguments.reserve(children_.size());
+
+		for (auto* arg : children_)
+			arguments.push_back(arg->eval(state));
+
+		state.parameter_stack = std::move(arguments);
+
+		auto return_value = target_function->get_caller()(state);
+
+		state.parameter_stack.clear();
+
+		return return_value;
+	}
+
+	// A parsed script together with the constants its nodes reference and the arena holding its nodes.
+	class compiled_script
+	{
+	public:
+		compiled_script() : nodes_(arena::create()), root_(nullptr)
+		{
+
 		}
 
-		if (ast_list.empty())
+		bean_value eval(bean_state& state) const
 		{
-			throw std::exception("Failed to parse statement!");
+			return code_->eval(state);
 		}
-		if (ast_list.size() == 1)
-			return ast_list[0];
-		else
+
+		[[nodiscard]] ast* get_root() const
 		{
-			resulting_ast = std::make_shared<ast_statement_list>();
-			resulting_ast->set_children(ast_list);
-			return resulting_ast;
+			return root_;
 		}
+
+		[[nodiscard]] const std::shared_ptr<const flat_ast>& get_code() const
+		{
+			return code_;
+		}
+
+		// The flat code compiled to bytecode, on first use. Defined in bytecode.hpp.
+		[[nodiscard]] const std::shared_ptr<const bytecode_program>& get_bytecode() const;
+
+		[[nodiscard]] const arena& get_arena() const
+		{
+			return *nodes_;
+		}
+
+		[[nodiscard]] const constant_pool& get_constants() const
+		{
+			return constants_;
+		}
+
+		[[nodiscard]] const symbol_table& get_symbols() const
+		{
+			return symbols_;
+		}
+
+		// Checks the script against a state before it is evaluated there. The script itself is not
+		// modified, one compiled_script can be linked against many states.
+		void link(const bean_state& state) const
+		{
+			symbols_.link(state);
+		}
+
+	private:
+		friend class ast_builder;
+		friend class precompiled;
+
+		symbol_table symbols_;
+		constant_pool constants_;
+		std::shared_ptr<arena> nodes_;
+		ast* root_;
+		std::shared_ptr<const flat_ast> code_;
+
+		mutable std::once_flag bytecode_compiled_;
+		mutable std::shared_ptr<const bytecode_program> bytecode_;
+	};
+
+	inline bean_value flat_ast::call(bean_state& state, const std::uint32_t index) const
+	{
+		const auto& node = nodes_[index];
+
+		if (node.kind == flat_node_kind::function)
+			return eval(state, node.left);
+
+		if (node.kind != flat_node_kind::lazy_function)
+			throw std::exception("Call to a node that does not define a function!");
+
+		return get_lazy_script(node.left).eval(state);
+	}
+
+	inline const compiled_script& flat_ast::get_lazy_script(const std::uint32_t body) const
+	{
+		const auto& lazy = lazy_bodies_[body];
+
+		// Programs are shared between threads, whichever call comes first parses the body for everyone.
+		std::call_once(lazy.parsed, [&lazy]
+		{
+			lazy.script = ast_builder::compile(lazy.tokens, lazy.first, lazy.last, true);
+		});
+
+		return *lazy.script;
+	}
+
+	inline bean_value ast_lazy_function::eval(bean_state& state)
+	{
+		const auto body = ast_builder::compile(tokens_, first_, last_, true);
+
+		auto new_function = std::make_shared<bean_function>(std::string(identifier_));
+
+		// Owning the compiled body keeps its arena alive.
+		new_function->set_ast(std::shared_ptr<ast>(body, body->get_root()));
+
+		state.set_function(identifier_, std::move(new_function));
+
+		return bean_value::none();
+	}
+
+	// Handle to a compiled script. Compiled scripts are never modified after compile returns, so a program can
+	// be run any number of times, by any number of states, from any thread.
+	using program = std::shared_ptr<const compiled_script>;
+
+	inline std::shared_ptr<compiled_script> ast_builder::compile(const token_stream& tokens)
+	{
+		return compile(tokens, thread_pool::shared());
+	}
+
+	inline std::shared_ptr<compiled_script> ast_builder::compile(const token_stream& tokens, thread_pool& pool)
+	{
+		auto script = std::make_shared<compiled_script>();
+		auto bodies = ast_parser::parse_function_bodies(tokens, pool);
+
+		ast_parser parser(tokens, script->symbols_, script->constants_, *script->nodes_);
+		parser.use_parsed_bodies(bodies);
+
+		script->root_ = parser.parse_program();
+		script->code_ = flat_ast::flatten(script->root_, script->constants_);
+		return script;
+	}
+
+	inline std::shared_ptr<compiled_script> ast_builder::compile(const std::shared_ptr<const token_stream>& tokens, const std::size_t first, const std::size_t last, const bool lazy_functions)
+	{
+		auto script = std::make_shared<compiled_script>();
+		script->root_ = ast_parser(*tokens, script->symbols_, script->constants_, *script->nodes_, lazy_functions ? tokens : nullptr, first, last).parse_program();
+		script->code_ = flat_ast::flatten(script->root_, script->constants_);
+		return script;
+	}
+
+	inline std::shared_ptr<compiled_script> ast_builder::compile(const std::shared_ptr<const token_stream>& tokens, const bool lazy_functions)
+	{
+		return compile(tokens, 0, tokens->size(), lazy_functions);
+	}
+
+	inline std::shared_ptr<compiled_script> ast_builder::compile(const token_stream& tokens, const bean_state& state)
+	{
+		auto script = compile(tokens);
+		script->link(state);
+		return script;
+	}
+
+	inline ast* ast_builder::parse(const token_array& tokens, symbol_table& symbols, constant_pool& constants, arena& nodes)
+	{
+		return parse(token_stream::from_token_array(tokens), symbols, constants, nodes);
+	}
+
+	inline ast* ast_builder::parse(const token_stream& tokens, symbol_table& symbols, constant_pool& constants, arena& nodes)
+	{
+		return ast_parser(tokens, symbols, constants, nodes).parse_program();
 	}
 
 
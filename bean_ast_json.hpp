@@ -6,29 +6,21 @@
 namespace bean
 {
 
-	std::string get_type(const std::shared_ptr<ast>& tree)
+	std::string get_type(const ast* tree)
 	{
-		return typeid(*tree.get()).name();
+		return typeid(*tree).name();
 	}
 
 
-	nlohmann::json ast_to_json(const std::shared_ptr<ast>& node, bean_state& state)
+	nlohmann::json ast_to_json(const flat_ast& code, const std::uint32_t index, bean_state& state)
 	{
 		nlohmann::json output = {};
 
-		if (!node)
-		{
-			return output;
-		}
-	
-		output["type"] = node->to_string();
-
-		auto str_rep = node->eval(state)->to_string();
+		output["type"] = code.to_string(index);
 
-		//if(strstr(str_rep.c_str(), "Identifier : to_string") < 0)
-		output["identifier"] = node->eval(state)->to_string();
+		output["identifier"] = code.eval(state, index).to_string();
 		
-		auto& children = node->get_children();
+		const auto children = code.get_children(index);
 
 		
 		if(!children.empty())
@@ -36,9 +28,9 @@ namespace bean
 			output["children"] = {};
 		}
 		
-		for(auto& child : children)
+		for(const auto child : children)
 		{
-			auto child_json = ast_to_json(child, state);
+			auto child_json = ast_to_json(code, child, state);
 			
 			output["children"].push_back(child_json);
 		}
@@ -52,11 +44,11 @@ namespace bean
 	{
 		bean_state state;
 		
-		const auto tokens = tokenizer::tokenize(script);
+		const auto tokens = tokenizer::tokenize_stream(script);
 
-		auto res = ast_builder::parse(tokens, state);
+		const auto compiled = ast_builder::compile(tokens, state);
 
-		return ast_to_json(res, state);
+		return ast_to_json(*compiled->get_code(), compiled->get_code()->get_root(), state);
 	}
 
 	
@@ -1,4 +1,7 @@
 #pragma once
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -6,6 +9,19 @@
 #include "fnv1a.hpp"
 // double, integer
 
+// Keeps a rarely taken path out of line, and inlines a hot one even into the interpreter loop, which is past the
+// size where compilers stop inlining on their own.
+#if defined(_MSC_VER)
+#define BEAN_NOINLINE __declspec(noinline)
+#define BEAN_FORCEINLINE __forceinline
+#elif defined(__GNUC__) || defined(__clang__)
+#define BEAN_NOINLINE __attribute__((noinline))
+#define BEAN_FORCEINLINE inline __attribute__((always_inline))
+#else
+#define BEAN_NOINLINE
+#define BEAN_FORCEINLINE inline
+#endif
+
 namespace bean {
 
 	enum class BeanObjectType
@@ -120,11 +136,26 @@ namespace bean {
 			return as<double>();
 		}
 
+		[[nodiscard]] std::int32_t as_int() const
+		{
+			return as<std::int32_t>();
+		}
+
+		[[nodiscard]] double as_double() const
+		{
+			return as<double>();
+		}
+
 		template<typename T> T& as()
 		{
 			return *static_cast<T*>(object_);
 		}
 
+		template<typename T> const T& as() const
+		{
+			return *static_cast<const T*>(object_);
+		}
+
 		template<typename T> T as_ptr()
 		{
 			return (T*)object_;
@@ -496,4 +527,410 @@ namespace bean {
 		}
 	}
 
-}
\ No newline at end of file
+	// Value of a script expression. Integers, doubles and None are held inline, so arithmetic on them never
+	// allocates. Other objects are boxed on the heap and the box is shared by all copies of the value. A
+	// default constructed value is undefined, which is how variable_table marks a variable that does not exist.
+	class bean_value
+	{
+	public:
+		BEAN_FORCEINLINE bean_value() : bits_(0)
+		{
+
+		}
+
+		// The integer is the low half of bits_ on the little endian targets bean builds for. Writing it in one
+		// store lets a copy read the whole value straight back, instead of waiting on two partial stores.
+		BEAN_FORCEINLINE bean_value(const std::int32_t value) : type_(BeanObjectType::INT), bits_(std::uint32_t(value))
+		{
+
+		}
+
+		BEAN_FORCEINLINE bean_value(const double value) : type_(BeanObjectType::DOUBLE), floating_(value)
+		{
+
+		}
+
+		// Numbers and None are unboxed, a null object is undefined.
+		bean_value(std::shared_ptr<bean_object> object) : bits_(0)
+		{
+			if (!object)
+				return;
+
+			type_ = object->type();
+
+			if (type_ == BeanObjectType::INT)
+				integer_ = object->as_int();
+			else if (type_ == BeanObjectType::DOUBLE)
+				floating_ = object->as_double();
+			else if (type_ != BeanObjectType::None)
+				box_ = new box{ { 1 }, std::move(object) };
+		}
+
+		static bean_value none()
+		{
+			bean_value value;
+			value.type_ = BeanObjectType::None;
+			return value;
+		}
+
+		BEAN_FORCEINLINE bean_value(const bean_value& other) : type_(other.type_), bits_(other.bits_)
+		{
+			if (boxed())
+				box_->references.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		BEAN_FORCEINLINE bean_value(bean_value&& other) noexcept : type_(other.type_), bits_(other.bits_)
+		{
+			other.type_ = BeanObjectType::INVALID;
+			other.bits_ = 0;
+		}
+
+		// Assignments between numbers are plain stores, only boxes are counted. The new contents are read before
+		// the old box is released, which may own them.
+		BEAN_FORCEINLINE bean_value& operator=(const bean_value& other)
+		{
+			const auto type = other.type_;
+			const auto bits = other.bits_;
+
+			if (other.boxed())
+				other.box_->references.fetch_add(1, std::memory_order_relaxed);
+
+			release();
+			type_ = type;
+			bits_ = bits;
+			return *this;
+		}
+
+		BEAN_FORCEINLINE bean_value& operator=(bean_value&& other) noexcept
+		{
+			if (this == &other)
+				return *this;
+
+			const auto type = other.type_;
+			const auto bits = other.bits_;
+			other.type_ = BeanObjectType::INVALID;
+			other.bits_ = 0;
+
+			release();
+			type_ = type;
+			bits_ = bits;
+			return *this;
+		}
+
+		BEAN_FORCEINLINE ~bean_value()
+		{
+			release();
+		}
+
+		// Makes the value undefined, releasing a box.
+		BEAN_FORCEINLINE void reset()
+		{
+			release();
+			type_ = BeanObjectType::INVALID;
+			bits_ = 0;
+		}
+
+		void swap(bean_value& other) noexcept
+		{
+			std::swap(type_, other.type_);
+			std::swap(bits_, other.bits_);
+		}
+
+		[[nodiscard]] BEAN_FORCEINLINE BeanObjectType type() const
+		{
+			return type_;
+		}
+
+		// False only for the undefined value.
+		explicit operator bool() const
+		{
+			return type_ != BeanObjectType::INVALID || bits_ != 0;
+		}
+
+		std::int32_t& as_int()
+		{
+			return boxed() ? box_->object->as_int() : integer_;
+		}
+
+		double& as_double()
+		{
+			return boxed() ? box_->object->as_double() : floating_;
+		}
+
+		[[nodiscard]] std::int32_t as_int() const
+		{
+			return boxed() ? box_->object->as_int() : integer_;
+		}
+
+		[[nodiscard]] double as_double() const
+		{
+			return boxed() ? box_->object->as_double() : floating_;
+		}
+
+		// The value as a heap object. Numbers and None are boxed anew, an undefined value gives nullptr.
+		[[nodiscard]] std::shared_ptr<bean_object> to_object() const
+		{
+			switch (type_)
+			{
+			case BeanObjectType::INT:
+				return std::make_shared<bean_object_integer>(integer_);
+			case BeanObjectType::DOUBLE:
+				return std::make_shared<bean_object_double>(floating_);
+			case BeanObjectType::None:
+				return std::make_shared<bean_object_none>();
+			default:
+				return boxed() ? box_->object : nullptr;
+			}
+		}
+
+		[[nodiscard]] std::string to_string() const
+		{
+			if (type_ == BeanObjectType::INT)
+				return std::to_string(integer_);
+
+			if (type_ == BeanObjectType::DOUBLE)
+				return std::to_string(floating_);
+
+			const auto object = to_object();
+			return object ? object->to_string() : "undefined";
+		}
+
+		// Dispatched on both operand types through operator_table.
+		[[nodiscard]] bean_value lh_plus(const bean_value& rh) const;
+		[[nodiscard]] bean_value lh_minus(const bean_value& rh) const;
+		[[nodiscard]] bean_value lh_multiply(const bean_value& rh) const;
+		[[nodiscard]] bean_value lh_divide(const bean_value& rh) const;
+		[[nodiscard]] bean_value lh_pow(const bean_value& rh) const;
+
+		// Numbers compare by type and bit pattern, boxed objects by identity.
+		friend bool operator==(const bean_value& lh, const bean_value& rh)
+		{
+			return lh.type_ == rh.type_ && lh.bits_ == rh.bits_;
+		}
+
+		friend bool operator!=(const bean_value& lh, const bean_value& rh)
+		{
+			return !(lh == rh);
+		}
+
+	private:
+		friend class operator_table;
+
+		struct box
+		{
+			std::atomic<std::uint32_t> references;
+			std::shared_ptr<bean_object> object;
+		};
+
+		BEAN_FORCEINLINE void release()
+		{
+			if (boxed())
+				release(box_);
+		}
+
+		BEAN_NOINLINE static void release(box* boxed)
+		{
+			if (boxed->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				delete boxed;
+		}
+
+		[[nodiscard]] BEAN_FORCEINLINE bool boxed() const
+		{
+			return type_ != BeanObjectType::INT && type_ != BeanObjectType::DOUBLE && type_ != BeanObjectType::None && box_ != nullptr;
+		}
+
+		BeanObjectType type_ = BeanObjectType::INVALID;
+
+		// bits_ is the whole payload, it is copied and compared without looking at the type.
+		union
+		{
+			std::uint64_t bits_;
+			std::int32_t integer_;
+			double floating_;
+			box* box_;
+		};
+	};
+
+	static_assert(sizeof(bean_value) == 16, "bean_value is meant to be 16 bytes");
+
+	enum class binary_operator : std::uint8_t
+	{
+		plus,
+		minus,
+		multiply,
+		divide,
+		pow
+	};
+
+	// Binary operators indexed by the operator and the types of both operands, so an operation costs one
+	// indirect call. Numbers have their own entries, references forward to the object they refer to and the
+	// remaining pairs fall back to the virtual lh_* methods of the boxed object.
+	class operator_table
+	{
+	public:
+		using handler = bean_value(*)(const bean_value& lh, const bean_value& rh);
+
+		static constexpr std::size_t operator_count = std::size_t(binary_operator::pow) + 1;
+		static constexpr std::size_t type_count = std::size_t(BeanObjectType::INT) + 1;
+
+		constexpr operator_table() : handlers_()
+		{
+			set_all<binary_operator::plus>();
+			set_all<binary_operator::minus>();
+			set_all<binary_operator::multiply>();
+			set_all<binary_operator::divide>();
+			set_all<binary_operator::pow>();
+		}
+
+		// The table used by every evaluator.
+		static operator_table& shared()
+		{
+			return shared_;
+		}
+
+		// Adds an operator for custom objects, at least one operand type must be CUSTOM. The table is read
+		// without locking, operators are meant to be registered before scripts run.
+		void set(const binary_operator op, const BeanObjectType lh, const BeanObjectType rh, const handler function)
+		{
+			if (lh != BeanObjectType::CUSTOM && rh != BeanObjectType::CUSTOM)
+				throw std::exception("Only operators on custom objects can be registered.");
+
+			handlers_[std::size_t(op)][std::size_t(lh)][std::size_t(rh)] = function;
+		}
+
+		[[nodiscard]] handler get(const binary_operator op, const BeanObjectType lh, const BeanObjectType rh) const
+		{
+			return handlers_[std::size_t(op)][std::size_t(lh)][std::size_t(rh)];
+		}
+
+		bean_value apply(const binary_operator op, const bean_value& lh, const bean_value& rh) const
+		{
+			return handlers_[std::size_t(op)][std::size_t(lh.type_)][std::size_t(rh.type_)](lh, rh);
+		}
+
+		template<binary_operator Op, typename T>
+		static constexpr T compute(const T lh, const T rh)
+		{
+			if constexpr (Op == binary_operator::plus)
+				return lh + rh;
+			else if constexpr (Op == binary_operator::minus)
+				return lh - rh;
+			else if constexpr (Op == binary_operator::multiply)
+				return lh * rh;
+			else if constexpr (Op == binary_operator::divide)
+				return lh / rh;
+			else
+				return std::pow(lh, rh);
+		}
+
+		// The number entries, public for code that already knows the operand types. Integer results stay
+		// integers for +, - and *. Division and powers always give a double.
+		template<binary_operator Op>
+		static bean_value int_int(const bean_value& lh, const bean_value& rh)
+		{
+			if constexpr (Op == binary_operator::divide || Op == binary_operator::pow)
+				return bean_value(compute<Op>(double(lh.integer_), double(rh.integer_)));
+			else
+				return bean_value(compute<Op>(lh.integer_, rh.integer_));
+		}
+
+		template<binary_operator Op>
+		static bean_value int_double(const bean_value& lh, const bean_value& rh)
+		{
+			return bean_value(compute<Op>(double(lh.integer_), rh.floating_));
+		}
+
+		template<binary_operator Op>
+		static bean_value double_int(const bean_value& lh, const bean_value& rh)
+		{
+			return bean_value(compute<Op>(lh.floating_, double(rh.integer_)));
+		}
+
+		template<binary_operator Op>
+		static bean_value double_double(const bean_value& lh, const bean_value& rh)
+		{
+			return bean_value(compute<Op>(lh.floating_, rh.floating_));
+		}
+
+	private:
+		template<binary_operator Op>
+		static bean_value reference(const bean_value& lh, const bean_value& rh)
+		{
+			const bean_value target(lh.box_->object->as<std::shared_ptr<bean_object>>());
+			return shared_.apply(Op, target, rh);
+		}
+
+		template<binary_operator Op>
+		static bean_value object(const bean_value& lh, const bean_value& rh)
+		{
+			const auto object = lh.to_object();
+
+			if (!object)
+				throw std::exception("Operator used on an undefined value!");
+
+			if constexpr (Op == binary_operator::plus)
+				return object->lh_plus(rh.to_object());
+			else if constexpr (Op == binary_operator::minus)
+				return object->lh_minus(rh.to_object());
+			else if constexpr (Op == binary_operator::multiply)
+				return object->lh_multiply(rh.to_object());
+			else if constexpr (Op == binary_operator::divide)
+				return object->lh_divide(rh.to_object());
+			else
+				return object->lh_pow(rh.to_object());
+		}
+
+		template<binary_operator Op>
+		constexpr void set_all()
+		{
+			auto& entries = handlers_[std::size_t(Op)];
+
+			for (auto& row : entries)
+			{
+				for (auto& entry : row)
+					entry = &object<Op>;
+			}
+
+			for (auto& entry : entries[std::size_t(BeanObjectType::REFERENCE)])
+				entry = &reference<Op>;
+
+			entries[std::size_t(BeanObjectType::INT)][std::size_t(BeanObjectType::INT)] = &int_int<Op>;
+			entries[std::size_t(BeanObjectType::INT)][std::size_t(BeanObjectType::DOUBLE)] = &int_double<Op>;
+			entries[std::size_t(BeanObjectType::DOUBLE)][std::size_t(BeanObjectType::INT)] = &double_int<Op>;
+			entries[std::size_t(BeanObjectType::DOUBLE)][std::size_t(BeanObjectType::DOUBLE)] = &double_double<Op>;
+		}
+
+		handler handlers_[operator_count][type_count][type_count];
+
+		static operator_table shared_;
+	};
+
+	// Constant initialized, the table is complete before any code runs.
+	inline operator_table operator_table::shared_;
+
+	inline bean_value bean_value::lh_plus(const bean_value& rh) const
+	{
+		return operator_table::shared().apply(binary_operator::plus, *this, rh);
+	}
+
+	inline bean_value bean_value::lh_minus(const bean_value& rh) const
+	{
+		return operator_table::shared().apply(binary_operator::minus, *this, rh);
+	}
+
+	inline bean_value bean_value::lh_multiply(const bean_value& rh) const
+	{
+		return operator_table::shared().apply(binary_operator::multiply, *this, rh);
+	}
+
+	inline bean_value bean_value::lh_divide(const bean_value& rh) const
+	{
+		return operator_table::shared().apply(binary_operator::divide, *this, rh);
+	}
+
+	inline bean_value bean_value::lh_pow(const bean_value& rh) const
+	{
+		return operator_table::shared().apply(binary_operator::pow, *this, rh);
+	}
+
+}
@@ -1,6 +1,9 @@
 #pragma once
 #include "utils.hpp"
 #include "bean_ast.hpp"
+#include "script_cache.hpp"
+#include "precompiled.hpp"
+#include "bytecode.hpp"
 #include <sstream>
 #include <algorithm>
 #include <string>
@@ -15,33 +18,336 @@ namespace bean {
 	{
 	public:
 
-		std::shared_ptr<bean_object> eval_result(const std::string& script)
+		bean_value eval_result(const std::string& script)
 		{
 
-			if (script.empty()) return std::make_shared<bean_object>(BeanObjectType::None);
+			if (script.empty()) return bean_value::none();
 
-			tokenizer token_gen;
+			return run(compile(script));
+		}
 
-			const auto tokens = tokenizer::tokenize(script);
+		// Compiles a script without running it, reusing the cached program for the same text.
+		program compile(const std::string& script)
+		{
+			auto compiled = cache_.find(script);
 
-			auto res = ast_builder::parse(tokens, state);
+			if (!compiled)
+			{
+				compiled = ast_builder::compile(std::make_shared<const token_stream>(tokenizer::tokenize_stream(script)), true);
+				cache_.insert(script, compiled);
+			}
 
-			return res->eval(state);
+			return compiled;
 		}
 
-		void eval(const std::string& script)
+		// Links the program against this VM's state and runs its bytecode.
+		bean_value run(const program& compiled)
 		{
-			eval_result(script);
+			compiled->link(state);
+
+			return execute(state, *compiled->get_bytecode());
 		}
 
-		std::shared_ptr<bean_object>  eval_file_result(const std::string& file_path)
+		static bean_value execute(bean_state& state, const bytecode_program& main)
 		{
-			std::ifstream t(file_path);
+			return execute<default_dispatch>(state, main);
+		}
+
+		// Dispatch loop of the bytecode. Operands live on the state's value stack, calls to script functions
+		// push a frame instead of recursing. Runs started from native functions stack on top of the caller's.
+		template<dispatch_mode Mode>
+		static bean_value execute(bean_state& state, const bytecode_program& main)
+		{
+			static_assert(Mode == dispatch_mode::switch_table || BEAN_THREADED_DISPATCH, "threaded dispatch is not available in this build");
+
+			auto& values = state.value_stack;
+			auto& frames = state.call_frames;
+
+			const auto base = state.value_top;
+			const auto frames_base = frames.size();
+			auto sp = base;
+
+			const auto reserve = [&values](const std::size_t size)
+			{
+				if (values.size() < size)
+					values.resize(std::max(size, values.size() * 2));
+
+				return values.data();
+			};
+
+			const bytecode_program* program = &main;
+			const instruction* code = program->get_instructions().data();
+			const instruction* pc = code;
+			const bean_value* constants = program->get_code()->get_constants().data();
+			auto* stack = reserve(sp + program->get_max_stack());
+
+			// Native functions waiting for their arguments to be evaluated.
+			std::vector<std::shared_ptr<bean_function>> natives;
+
+			const auto enter = [&](const bytecode_program* target, const std::uint32_t entry, const std::uint32_t max_stack)
+			{
+				program = target;
+				code = program->get_instructions().data();
+				pc = code + entry;
+				constants = program->get_code()->get_constants().data();
+				stack = reserve(sp + max_stack);
+			};
+
+#if BEAN_THREADED_DISPATCH
+			// In opcode order.
+			static void* const handlers[] = {
+				&&handle_push_constant, &&handle_push_none, &&handle_load_variable, &&handle_define_empty,
+				&&handle_define_variable, &&handle_require_variable, &&handle_store_variable, &&handle_add,
+				&&handle_subtract, &&handle_multiply, &&handle_divide, &&handle_power, &&handle_pop,
+				&&handle_define_function, &&handle_call, &&handle_call_native, &&handle_ret, &&handle_add_int_int,
+				&&handle_subtract_int_int, &&handle_multiply_int_int, &&handle_divide_int_int, &&handle_power_int_int,
+				&&handle_add_double_double, &&handle_subtract_double_double, &&handle_multiply_double_double,
+				&&handle_divide_double_double, &&handle_power_double_double
+			};
+
+			static_assert(sizeof(handlers) / sizeof(handlers[0]) == opcode_count, "every opcode needs a handler");
+
+			// Threaded code jumps from each handler straight to the next one, the switch goes back to the loop.
+#define BEAN_HANDLER(name) case opcode::name: handle_##name:
+#define BEAN_NEXT() if constexpr (Mode == dispatch_mode::threaded) { in = pc++; goto *handlers[static_cast<std::size_t>(in->get_op())]; } else continue
+#else
+#define BEAN_HANDLER(name) case opcode::name:
+#define BEAN_NEXT() continue
+#endif
+
+			const instruction* in;
+
+			// sp stays a plain local the loop can keep in a register, the stacks are restored by hand.
+			try
+			{
+#if BEAN_THREADED_DISPATCH
+				if constexpr (Mode == dispatch_mode::threaded)
+				{
+					in = pc++;
+					goto *handlers[static_cast<std::size_t>(in->get_op())];
+				}
+#endif
+
+				for (;;)
+				{
+					in = pc++;
 
-			const std::string str((std::istreambuf_iterator<char>(t)),
-				std::istreambuf_iterator<char>());
+					switch (in->get_op())
+					{
+					BEAN_HANDLER(push_constant)
+						stack[sp++] = constants[in->operand];
+						BEAN_NEXT();
+					BEAN_HANDLER(push_none)
+						stack[sp++] = bean_value::none();
+						BEAN_NEXT();
+					BEAN_HANDLER(load_variable)
+					{
+						const auto* found = state.variables.find(in->operand);
 
-			return eval_result(str);
+						if (!found)
+							throw std::exception("Unknown variable!");
+
+						stack[sp++] = *found;
+					}
+					BEAN_NEXT();
+					BEAN_HANDLER(define_empty)
+						state.variables.set(in->operand, bean_value::none());
+						BEAN_NEXT();
+					BEAN_HANDLER(define_variable)
+						state.variables.set(in->operand, std::move(stack[--sp]));
+						BEAN_NEXT();
+					BEAN_HANDLER(require_variable)
+						if (!state.variables.find(in->operand))
+							throw std::exception("Invalid variable name!");
+						BEAN_NEXT();
+					BEAN_HANDLER(store_variable)
+						if (!state.variables.find(in->operand))
+							throw std::exception("Invalid variable name!");
+
+						state.variables.set(in->operand, std::move(stack[--sp]));
+						BEAN_NEXT();
+					BEAN_HANDLER(add)
+						sp--;
+						generic<binary_operator::plus>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(subtract)
+						sp--;
+						generic<binary_operator::minus>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(multiply)
+						sp--;
+						generic<binary_operator::multiply>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(divide)
+						sp--;
+						generic<binary_operator::divide>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(power)
+						sp--;
+						generic<binary_operator::pow>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(add_int_int)
+						sp--;
+						quickened<binary_operator::plus, BeanObjectType::INT>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(subtract_int_int)
+						sp--;
+						quickened<binary_operator::minus, BeanObjectType::INT>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(multiply_int_int)
+						sp--;
+						quickened<binary_operator::multiply, BeanObjectType::INT>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(divide_int_int)
+						sp--;
+						quickened<binary_operator::divide, BeanObjectType::INT>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(power_int_int)
+						sp--;
+						quickened<binary_operator::pow, BeanObjectType::INT>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(add_double_double)
+						sp--;
+						quickened<binary_operator::plus, BeanObjectType::DOUBLE>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(subtract_double_double)
+						sp--;
+						quickened<binary_operator::minus, BeanObjectType::DOUBLE>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(multiply_double_double)
+						sp--;
+						quickened<binary_operator::multiply, BeanObjectType::DOUBLE>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(divide_double_double)
+						sp--;
+						quickened<binary_operator::divide, BeanObjectType::DOUBLE>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(power_double_double)
+						sp--;
+						quickened<binary_operator::pow, BeanObjectType::DOUBLE>(*program, *in, stack[sp - 1], stack[sp]);
+						BEAN_NEXT();
+					BEAN_HANDLER(pop)
+						stack[--sp].reset();
+						BEAN_NEXT();
+					BEAN_HANDLER(define_function)
+						define_function(state, *program, in->operand);
+						BEAN_NEXT();
+					BEAN_HANDLER(call)
+					{
+						const auto& site = program->get_calls()[in->operand];
+						auto* target = state.find_function(site.slot, program->get_code()->get_names()[site.name]);
+
+						if (!target)
+							throw std::exception("Call to an undefined function!");
+
+						if (const auto& callee = target->get_bytecode())
+						{
+							const auto& function = callee->get_functions()[target->get_bytecode_function()];
+
+							// Arguments only matter to native functions and are skipped.
+							frames.push_back({ program, site.end });
+							state.enter_call();
+
+							if (function.lazy)
+							{
+								const auto& body = callee->get_code()->get_lazy_script(function.entry).get_bytecode();
+								enter(body.get(), 0, body->get_max_stack());
+							}
+							else
+							{
+								enter(callee.get(), function.entry, function.max_stack);
+							}
+						}
+						else if (target->get_code() || target->get_ast())
+						{
+							bean_value result;
+							state.value_top = sp;
+
+							{
+								const bean_state::call_scope scope(state);
+								result = target->get_code() ? target->get_code()->call(state, target->get_entry()) : target->get_ast()->eval(state);
+							}
+
+							stack = values.data();
+							stack[sp++] = std::move(result);
+							pc = code + site.end;
+						}
+						else
+						{
+							natives.push_back(target->shared_from_this());
+						}
+					}
+					BEAN_NEXT();
+					BEAN_HANDLER(call_native)
+					{
+						const auto& site = program->get_calls()[in->operand];
+						const auto target = std::move(natives.back());
+						natives.pop_back();
+
+						state.parameter_stack.assign(std::make_move_iterator(stack + sp - site.arguments), std::make_move_iterator(stack + sp));
+						sp -= site.arguments;
+
+						bean_value result;
+						state.value_top = sp;
+
+						{
+							const bean_state::call_scope scope(state);
+							result = target->get_caller()(state);
+						}
+
+						state.parameter_stack.clear();
+
+						stack = values.data();
+						stack[sp++] = std::move(result);
+					}
+					BEAN_NEXT();
+					BEAN_HANDLER(ret)
+					{
+						if (frames.size() == frames_base)
+						{
+							auto result = std::move(stack[--sp]);
+							unwind(state, base, frames_base, sp);
+							return result;
+						}
+
+						const auto frame = frames.back();
+						frames.pop_back();
+						state.leave_call();
+
+						enter(frame.program, frame.return_pc, 0);
+					}
+					BEAN_NEXT();
+					}
+				}
+			}
+			catch (...)
+			{
+				unwind(state, base, frames_base, sp);
+				throw;
+			}
+
+#undef BEAN_HANDLER
+#undef BEAN_NEXT
+		}
+
+		bean_value eval_source(const source_buffer_ptr& source)
+		{
+			if (source->size() == 0) return bean_value::none();
+
+			// Function bodies are parsed when first called, so a large library that is mostly unused loads fast.
+			const auto tokens = std::make_shared<const token_stream>(tokenizer::tokenize_stream(source));
+
+			return run(ast_builder::compile(tokens, true));
+		}
+
+		void eval(const std::string& script)
+		{
+			eval_result(script);
+		}
+
+		bean_value eval_file_result(const std::string& file_path)
+		{
+			return eval_source(source_buffer::map_file(file_path));
 		}
 
 		void eval_file(const std::string& file_path)
@@ -49,17 +355,34 @@ namespace bean {
 			eval_file_result(file_path);
 		}
 
+		// Maps a script written by precompile_file, no tokenizing or parsing happens on load.
+		program load_compiled(const std::string& file_path)
+		{
+			return precompiled::load_file(file_path);
+		}
+
 		bean_state& get_state()
 		{
 			return state;
 		}
 
+		// Scripts passed to eval_result as text are compiled once and reused from here.
+		script_cache& get_cache()
+		{
+			return cache_;
+		}
+
+		void set_cache_capacity(const std::size_t capacity)
+		{
+			cache_.set_capacity(capacity);
+		}
+
 		template<typename Ret, typename ...Args>
 		void bind_function(const std::string& function_name, Ret(__cdecl* func)(Args...))
 		{
 			auto new_function = std::make_shared<bean_function>(function_name);
 			new_function->set_caller(bind_non_member_function(function_name, func));
-			state.functions[function_name] = new_function;
+			state.set_function(function_name, std::move(new_function));
 		}
 
 		template<typename Ret, typename ...Args>
@@ -67,11 +390,92 @@ namespace bean {
 		{
 			auto new_function = std::make_shared<bean_function>(function_name);
 			new_function->set_caller(bind_non_member_function(function_name, func));
-			state.functions[function_name] = new_function;
+			state.set_function(function_name, std::move(new_function));
 		}
 
 	private:
+		// Leaves the stacks of a run as they were found.
+		static void unwind(bean_state& state, const std::size_t base, const std::size_t frames_base, const std::size_t sp)
+		{
+			for (auto i = base; i < sp; i++)
+				state.value_stack[i].reset();
+
+			while (state.call_frames.size() > frames_base)
+			{
+				state.call_frames.pop_back();
+				state.leave_call();
+			}
+
+			state.value_top = base;
+		}
+
+		// Arithmetic on operands of any type. Numbers are computed in line, everything else goes through the
+		// operator table.
+		template<binary_operator Op>
+		BEAN_FORCEINLINE static void generic(const bytecode_program& program, const instruction& in, bean_value& lh, bean_value& rh)
+		{
+			program.observe(in, opcode(std::size_t(opcode::add) + std::size_t(Op)), lh, rh);
+
+			const auto lh_type = lh.type();
+			const auto rh_type = rh.type();
+
+			if (lh_type == BeanObjectType::INT && rh_type == BeanObjectType::INT)
+				lh = operator_table::int_int<Op>(lh, rh);
+			else if (lh_type == BeanObjectType::INT && rh_type == BeanObjectType::DOUBLE)
+				lh = operator_table::int_double<Op>(lh, rh);
+			else if (lh_type == BeanObjectType::DOUBLE && rh_type == BeanObjectType::INT)
+				lh = operator_table::double_int<Op>(lh, rh);
+			else if (lh_type == BeanObjectType::DOUBLE && rh_type == BeanObjectType::DOUBLE)
+				lh = operator_table::double_double<Op>(lh, rh);
+			else
+				lh = operator_table::shared().apply(Op, lh, rh);
+
+			rh.reset();
+		}
+
+		// Arithmetic specialized for operands of type Type. Operands of other types send the instruction back
+		// to its generic form.
+		template<binary_operator Op, BeanObjectType Type>
+		BEAN_FORCEINLINE static void quickened(const bytecode_program& program, const instruction& in, bean_value& lh, bean_value& rh)
+		{
+			if (lh.type() == Type && rh.type() == Type)
+			{
+				if constexpr (Type == BeanObjectType::INT)
+					lh = operator_table::int_int<Op>(lh, rh);
+				else
+					lh = operator_table::double_double<Op>(lh, rh);
+			}
+			else
+			{
+				constexpr auto first = Type == BeanObjectType::INT ? opcode::add_int_int : opcode::add_double_double;
+				program.despecialize(in, opcode(std::size_t(first) + std::size_t(Op)));
+				lh = operator_table::shared().apply(Op, lh, rh);
+			}
+
+			rh.reset();
+		}
+
+		static void define_function(bean_state& state, const bytecode_program& program, const std::uint32_t index)
+		{
+			const auto& function = program.get_functions()[index];
+			const auto name = program.get_code()->get_names()[function.name];
+			const auto* existing = state.find_function(function.slot, name);
+
+			// Running a program again leaves its functions and the cached calls to them in place.
+			if (existing && existing->get_bytecode().get() == &program && existing->get_bytecode_function() == index)
+				return;
+
+			auto new_function = std::make_shared<bean_function>(std::string(name));
+
+			// The flat code lets the other evaluators call the function too.
+			new_function->set_code(program.get_code(), function.node);
+			new_function->set_bytecode(program.shared_from_this(), index);
+
+			state.set_function(name, std::move(new_function));
+		}
+
 		bean_state state;
+		script_cache cache_;
 	};
 
 }
\ No newline at end of file
@@ -5,27 +5,27 @@ namespace bean {
 
 	template<typename T> struct BoundBeanReturn
 	{
-		inline static bean_object_ptr get(T value)
+		inline static bean_value get(T value)
 		{
 			static_assert(false, "No support for return type in bound function.");
-			return nullptr;
+			return {};
 		}
 	};
 
 	template<> struct BoundBeanReturn<std::int32_t>
 	{
-		inline static bean_object_ptr get(std::int32_t value)
+		inline static bean_value get(std::int32_t value)
 		{
-			return std::make_shared<bean_object_integer>(value);
+			return bean_value(value);
 		}
 	};
 
 
 	template<> struct BoundBeanReturn<double>
 	{
-		inline static bean_object_ptr get(double value)
+		inline static bean_value get(double value)
 		{
-			return std::make_shared<bean_object_double>(value);
+			return bean_value(value);
 		}
 	};
 
@@ -44,12 +44,12 @@ namespace bean {
 		{
 			auto& param = state.parameter_stack[arg_idx];
 
-			if (param->type() != BeanObjectType::INT)
+			if (param.type() != BeanObjectType::INT)
 			{
 				throw std::exception("Invalid Parameter type!");
 			}
 
-			return param->as_int();
+			return param.as_int();
 		}
 	};
 
@@ -59,12 +59,12 @@ namespace bean {
 		{
 			auto& param = state.parameter_stack[arg_idx];
 
-			if (param->type() != BeanObjectType::DOUBLE)
+			if (param.type() != BeanObjectType::DOUBLE)
 			{
 				throw std::exception("Invalid Parameter type!");
 			}
 
-			return param->as_double();
+			return param.as_double();
 		}
 	};
 
@@ -80,7 +80,7 @@ namespace bean {
 		// Args is sorta like an array that is {int, double}
 
 		// Create a caller lambda. Basically we return this function and that is used to call the function.
-		bean_function_caller lambda = [func](bean_state& state) -> bean_object_ptr
+		bean_function_caller lambda = [func](bean_state& state) -> bean_value
 		{
 			// Gets the ammount of parameters of the function we want to call. Special sizeof... syntax.
 			constexpr std::int32_t paramCount = sizeof...(Args);
@@ -108,7 +108,7 @@ namespace bean {
 				else
 					func();
 
-				return std::make_shared<bean_object_none>();
+				return bean_value::none();
 			}
 
 			// above is where the magic happens, this can be broken up into a few steps
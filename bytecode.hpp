@@ -0,0 +1,497 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bean_ast.hpp"
+
+// Direct threaded dispatch needs labels as values, an extension of GCC and Clang. Define BEAN_THREADED_DISPATCH
+// as 0 to build only the portable switch loop.
+#if !defined(BEAN_THREADED_DISPATCH)
+#if defined(__GNUC__) || defined(__clang__)
+#define BEAN_THREADED_DISPATCH 1
+#else
+#define BEAN_THREADED_DISPATCH 0
+#endif
+#endif
+
+namespace bean {
+
+	// How the interpreter gets from one instruction to the next.
+	enum class dispatch_mode
+	{
+		// One indirect branch shared by all opcodes.
+		switch_table,
+		// Every handler ends in its own indirect jump to the next handler.
+		threaded
+	};
+
+	static constexpr dispatch_mode default_dispatch = BEAN_THREADED_DISPATCH ? dispatch_mode::threaded : dispatch_mode::switch_table;
+
+	enum class opcode : std::uint8_t
+	{
+		push_constant,    // operand = constant index
+		push_none,
+		load_variable,    // operand = variable slot
+		define_empty,     // operand = variable slot
+		define_variable,  // operand = variable slot, pops the value
+		require_variable, // operand = variable slot, throws unless the variable is defined
+		store_variable,   // operand = variable slot, pops the value into a defined variable
+		add,
+		subtract,
+		multiply,
+		divide,
+		power,
+		pop,
+		define_function,  // operand = function index
+		call,             // operand = call site. Runs a script function, a native one continues with its arguments
+		call_native,      // operand = call site, pops the arguments and calls the native function
+		ret,
+		// Arithmetic quickened for the operand types a site keeps seeing, see bytecode_program::observe.
+		add_int_int,
+		subtract_int_int,
+		multiply_int_int,
+		divide_int_int,
+		power_int_int,
+		add_double_double,
+		subtract_double_double,
+		multiply_double_double,
+		divide_double_double,
+		power_double_double
+	};
+
+	static constexpr std::size_t opcode_count = std::size_t(opcode::power_double_double) + 1;
+
+	static_assert(std::size_t(opcode::power) - std::size_t(opcode::add) == std::size_t(binary_operator::pow), "arithmetic opcodes follow binary_operator");
+	static_assert(std::size_t(opcode::power_int_int) - std::size_t(opcode::add_int_int) == std::size_t(binary_operator::pow), "arithmetic opcodes follow binary_operator");
+	static_assert(std::size_t(opcode::power_double_double) - std::size_t(opcode::add_double_double) == std::size_t(binary_operator::pow), "arithmetic opcodes follow binary_operator");
+
+	// The opcode is rewritten while programs run. Relaxed atomic accesses compile to plain loads and stores,
+	// dispatch costs the same as with a plain field.
+	struct instruction
+	{
+		instruction(const opcode op, const std::uint32_t operand) : op(op), operand(operand)
+		{
+
+		}
+
+		instruction(const instruction& other) : op(other.get_op()), operand(other.operand)
+		{
+
+		}
+
+		instruction& operator=(const instruction& other)
+		{
+			op.store(other.get_op(), std::memory_order_relaxed);
+			operand = other.operand;
+			return *this;
+		}
+
+		[[nodiscard]] opcode get_op() const
+		{
+			return op.load(std::memory_order_relaxed);
+		}
+
+		mutable std::atomic<opcode> op;
+		std::uint32_t operand;
+	};
+
+	static_assert(sizeof(instruction) == 8, "instructions are meant to be 8 bytes");
+	static_assert(std::atomic<opcode>::is_always_lock_free, "opcodes are rewritten without locking");
+
+	// Flat code compiled for the stack machine in bean_vm. The main code starts at instruction 0, function
+	// bodies follow it. Every code block ends in ret with its result as the only value it left on the stack.
+	class bytecode_program : public std::enable_shared_from_this<bytecode_program>
+	{
+	public:
+		struct function
+		{
+			std::uint32_t name;
+			// function_slots number of the name, so running the definition again is a cached lookup.
+			std::uint32_t slot;
+			// Node of the flat code that defines the function.
+			std::uint32_t node;
+			// First instruction of the body, or the lazy body index in the flat code.
+			std::uint32_t entry;
+			std::uint32_t max_stack;
+			bool lazy;
+		};
+
+		struct call_site
+		{
+			std::uint32_t name;
+			std::uint32_t slot;
+			std::uint32_t arguments;
+			// Instruction after the call_native, where a call to a script function continues.
+			std::uint32_t end;
+		};
+
+		static std::shared_ptr<const bytecode_program> compile(std::shared_ptr<const flat_ast> code);
+
+		[[nodiscard]] const std::vector<instruction>& get_instructions() const
+		{
+			return instructions_;
+		}
+
+		[[nodiscard]] const std::vector<function>& get_functions() const
+		{
+			return functions_;
+		}
+
+		[[nodiscard]] const std::vector<call_site>& get_calls() const
+		{
+			return calls_;
+		}
+
+		[[nodiscard]] const std::shared_ptr<const flat_ast>& get_code() const
+		{
+			return code_;
+		}
+
+		// Stack the main code needs at most.
+		[[nodiscard]] std::uint32_t get_max_stack() const
+		{
+			return max_stack_;
+		}
+
+		// One instruction per line, for tests and debugging.
+		[[nodiscard]] std::string disassemble() const;
+
+		static const char* opcode_name(opcode op)
+		{
+			static const char* const names[] = {
+				"push_constant", "push_none", "load_variable", "define_empty", "define_variable", "require_variable",
+				"store_variable", "add", "subtract", "multiply", "divide", "power", "pop", "define_function", "call",
+				"call_native", "ret", "add_int_int", "subtract_int_int", "multiply_int_int", "divide_int_int",
+				"power_int_int", "add_double_double", "subtract_double_double", "multiply_double_double",
+				"divide_double_double", "power_double_double"
+			};
+
+			static_assert(sizeof(names) / sizeof(names[0]) == opcode_count, "every opcode needs a name");
+
+			return names[static_cast<std::size_t>(op)];
+		}
+
+		// Runs of a generic arithmetic instruction before it is quickened.
+		static constexpr std::uint8_t quickening_threshold = 4;
+
+		struct quickening_counters
+		{
+			// Generic arithmetic instructions in the program.
+			std::uint32_t sites;
+			// Sites rewritten into a form specialized for their operand types.
+			std::uint32_t specialized;
+			// Specialized sites that met other types and went back to the generic form.
+			std::uint32_t despecialized;
+		};
+
+		[[nodiscard]] quickening_counters get_quickening() const
+		{
+			return { sites_, specialized_.load(std::memory_order_relaxed), despecialized_.load(std::memory_order_relaxed) };
+		}
+
+		// Called on each run by the generic arithmetic instruction in, generic being the opcode it was dispatched
+		// on. Once it ran quickening_threshold times and both operands are integers, or both doubles, it is
+		// rewritten into the specialized form. Another thread may have rewritten it meanwhile, so the opcode is
+		// never read back from in.
+		BEAN_FORCEINLINE void observe(const instruction& in, const opcode generic, const bean_value& lh, const bean_value& rh) const
+		{
+			auto& runs = runs_[&in - instructions_.data()];
+			const auto count = runs.load(std::memory_order_relaxed);
+
+			// Most runs of a generic site are past deciding.
+			if (count != generic_forever)
+				count_run(in, generic, lh, rh, runs, count);
+		}
+
+		// Called by a specialized instruction whose operands have other types, specialized being the opcode it
+		// was dispatched on. The site stays generic.
+		void despecialize(const instruction& in, opcode specialized) const
+		{
+			const auto generic = opcode(std::size_t(opcode::add) + (std::size_t(specialized) - std::size_t(opcode::add_int_int)) % operator_table::operator_count);
+
+			if (in.op.compare_exchange_strong(specialized, generic, std::memory_order_relaxed))
+				despecialized_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+	private:
+		class compiler;
+
+		static constexpr std::uint8_t generic_forever = 0xff;
+
+		// The counting and rewriting half of observe.
+		BEAN_NOINLINE void count_run(const instruction& in, opcode generic, const bean_value& lh, const bean_value& rh, std::atomic<std::uint8_t>& runs, const std::uint8_t count) const
+		{
+			if (count + 1 < quickening_threshold)
+			{
+				// A count lost to a concurrent run only delays quickening.
+				runs.store(std::uint8_t(count + 1), std::memory_order_relaxed);
+				return;
+			}
+
+			runs.store(generic_forever, std::memory_order_relaxed);
+
+			const auto offset = std::size_t(generic) - std::size_t(opcode::add);
+			opcode specialized;
+
+			if (lh.type() == BeanObjectType::INT && rh.type() == BeanObjectType::INT)
+				specialized = opcode(std::size_t(opcode::add_int_int) + offset);
+			else if (lh.type() == BeanObjectType::DOUBLE && rh.type() == BeanObjectType::DOUBLE)
+				specialized = opcode(std::size_t(opcode::add_double_double) + offset);
+			else
+				return;
+
+			if (in.op.compare_exchange_strong(generic, specialized, std::memory_order_relaxed))
+				specialized_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		std::shared_ptr<const flat_ast> code_;
+		std::vector<instruction> instructions_;
+		std::vector<function> functions_;
+		std::vector<call_site> calls_;
+		std::uint32_t max_stack_ = 0;
+
+		// Quickening state, the only part of a program that changes after compile.
+		std::uint32_t sites_ = 0;
+		std::unique_ptr<std::atomic<std::uint8_t>[]> runs_;
+		mutable std::atomic<std::uint32_t> specialized_{ 0 };
+		mutable std::atomic<std::uint32_t> despecialized_{ 0 };
+	};
+
+	class bytecode_program::compiler
+	{
+	public:
+		explicit compiler(bytecode_program& program) : program_(program), code_(*program.code_)
+		{
+
+		}
+
+		void compile()
+		{
+			program_.max_stack_ = block(code_.get_root());
+
+			// Bodies follow the code defining them, the list grows while nested functions are found.
+			for (std::size_t i = 0; i < program_.functions_.size(); i++)
+			{
+				if (program_.functions_[i].lazy)
+					continue;
+
+				program_.functions_[i].entry = std::uint32_t(program_.instructions_.size());
+
+				const auto max_stack = block(code_.get_nodes()[program_.functions_[i].node].left);
+				program_.functions_[i].max_stack = max_stack;
+			}
+		}
+
+	private:
+		std::uint32_t block(const std::uint32_t root)
+		{
+			depth_ = 0;
+			max_depth_ = 0;
+
+			emit(root, true);
+			op(opcode::ret, 0, -1);
+
+			return max_depth_;
+		}
+
+		void op(const opcode code, const std::uint32_t operand, const int stack_effect)
+		{
+			program_.instructions_.push_back({ code, operand });
+
+			depth_ += stack_effect;
+			max_depth_ = std::max(max_depth_, std::uint32_t(std::max(depth_, 0)));
+		}
+
+		void none(const bool value)
+		{
+			if (value)
+				op(opcode::push_none, 0, 1);
+		}
+
+		void discard(const bool value)
+		{
+			if (!value)
+				op(opcode::pop, 0, -1);
+		}
+
+		bool has_call(const std::uint32_t index) const
+		{
+			if (code_.get_nodes()[index].kind == flat_node_kind::call)
+				return true;
+
+			for (const auto child : code_.get_children(index))
+			{
+				if (has_call(child))
+					return true;
+			}
+
+			return false;
+		}
+
+		// Code for the node at index, leaving its value on the stack when value is set.
+		void emit(const std::uint32_t index, const bool value)
+		{
+			const auto& node = code_.get_nodes()[index];
+
+			switch (node.kind)
+			{
+			case flat_node_kind::integer:
+			case flat_node_kind::floating:
+				if (value)
+					op(opcode::push_constant, node.left, 1);
+				break;
+			case flat_node_kind::plus:
+			case flat_node_kind::minus:
+			case flat_node_kind::multiply:
+			case flat_node_kind::divide:
+			case flat_node_kind::pow:
+			{
+				static const opcode operators[] = { opcode::add, opcode::subtract, opcode::multiply, opcode::divide, opcode::power };
+
+				emit(node.left, true);
+				emit(node.right, true);
+				op(operators[static_cast<std::size_t>(node.kind) - static_cast<std::size_t>(flat_node_kind::plus)], 0, -1);
+				program_.sites_++;
+				discard(value);
+			}
+			break;
+			case flat_node_kind::define_var:
+				op(opcode::define_empty, code_.get_slots()[node.name], 0);
+				none(value);
+				break;
+			case flat_node_kind::variable_reference:
+				// Loaded even when unused, an unknown variable still throws.
+				op(opcode::load_variable, code_.get_slots()[node.name], 1);
+				discard(value);
+				break;
+			case flat_node_kind::ret:
+				emit(node.left, value);
+				break;
+			case flat_node_kind::define_and_set_var:
+				emit(node.left, true);
+				op(opcode::define_variable, code_.get_slots()[node.name], -1);
+				none(value);
+				break;
+			case flat_node_kind::set_var:
+				// The target is checked before a value with side effects is evaluated.
+				if (has_call(node.right))
+					op(opcode::require_variable, code_.get_slots()[node.name], 0);
+
+				emit(node.right, true);
+				op(opcode::store_variable, code_.get_slots()[node.name], -1);
+				none(value);
+				break;
+			case flat_node_kind::function:
+			case flat_node_kind::lazy_function:
+			{
+				const auto lazy = node.kind == flat_node_kind::lazy_function;
+
+				program_.functions_.push_back({ node.name, function_slots::resolve(code_.get_names()[node.name]), index,
+					lazy ? node.left : 0, 0, lazy });
+				op(opcode::define_function, std::uint32_t(program_.functions_.size() - 1), 0);
+				none(value);
+			}
+			break;
+			case flat_node_kind::call:
+			{
+				const auto site = std::uint32_t(program_.calls_.size());
+				program_.calls_.push_back({ node.name, code_.get_call_slots()[node.name], node.right, 0 });
+
+				op(opcode::call, site, 0);
+
+				for (std::uint32_t i = 0; i < node.right; i++)
+					emit(code_.get_operands()[node.left + i], true);
+
+				op(opcode::call_native, site, 1 - int(node.right));
+				program_.calls_[site].end = std::uint32_t(program_.instructions_.size());
+
+				discard(value);
+			}
+			break;
+			case flat_node_kind::statement_list:
+				for (std::uint32_t i = 0; i < node.right; i++)
+					emit(code_.get_operands()[node.left + i], value && i + 1 == node.right);
+
+				if (node.right == 0)
+					none(value);
+				break;
+			default:
+				throw std::exception("Unable to compile flat node to bytecode.");
+			}
+		}
+
+		bytecode_program& program_;
+		const flat_ast& code_;
+		int depth_ = 0;
+		std::uint32_t max_depth_ = 0;
+	};
+
+	inline std::shared_ptr<const bytecode_program> bytecode_program::compile(std::shared_ptr<const flat_ast> code)
+	{
+		auto program = std::make_shared<bytecode_program>();
+		program->code_ = std::move(code);
+
+		compiler(*program).compile();
+
+		// Zero initialized, atomics can not live in a vector.
+		program->runs_.reset(new std::atomic<std::uint8_t>[program->instructions_.size()]());
+
+		return program;
+	}
+
+	inline std::string bytecode_program::disassemble() const
+	{
+		std::stringstream stream;
+
+		for (std::size_t i = 0; i < instructions_.size(); i++)
+		{
+			const auto& in = instructions_[i];
+
+			stream << i << " " << opcode_name(in.get_op());
+
+			switch (in.get_op())
+			{
+			case opcode::push_constant:
+				stream << " " << code_->get_constants()[in.operand].to_string();
+				break;
+			case opcode::load_variable:
+			case opcode::define_empty:
+			case opcode::define_variable:
+			case opcode::require_variable:
+			case opcode::store_variable:
+				stream << " slot " << in.operand;
+				break;
+			case opcode::define_function:
+				stream << " " << code_->get_names()[functions_[in.operand].name];
+				break;
+			case opcode::call:
+			case opcode::call_native:
+				stream << " " << code_->get_names()[calls_[in.operand].name] << " " << calls_[in.operand].arguments;
+				break;
+			default:
+				break;
+			}
+
+			stream << "\n";
+		}
+
+		return stream.str();
+	}
+
+	inline const std::shared_ptr<const bytecode_program>& compiled_script::get_bytecode() const
+	{
+		// Compiled on first run, a program can be run by several threads at once.
+		std::call_once(bytecode_compiled_, [this]
+		{
+			bytecode_ = bytecode_program::compile(code_);
+		});
+
+		return bytecode_;
+	}
+
+}
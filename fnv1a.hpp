@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
 
 // FNV1a c++11 constexpr compile time hash functions, 32 and 64 bit
 // str should be a null terminated string literal, value should be left out 
@@ -18,4 +19,18 @@ inline constexpr uint32_t hash_32_fnv1a_const(const char* const str, const uint3
 
 inline constexpr uint64_t hash_64_fnv1a_const(const char* const str, const uint64_t value = val_64_const) noexcept {
 	return (str[0] == '\0') ? value : hash_64_fnv1a_const(&str[1], (value ^ uint64_t(str[0])) * prime_64_const);
-}
\ No newline at end of file
+}
+
+// Same as hash_32_fnv1a_const for a string that is not null terminated.
+inline constexpr uint32_t hash_32_fnv1a(const char* const str, const size_t length, uint32_t value = val_32_const) noexcept {
+	for (size_t i = 0; i < length; i++)
+		value = (value ^ uint32_t(str[i])) * prime_32_const;
+	return value;
+}
+
+// Same as hash_64_fnv1a_const for a string that is not null terminated.
+inline constexpr uint64_t hash_64_fnv1a(const char* const str, const size_t length, uint64_t value = val_64_const) noexcept {
+	for (size_t i = 0; i < length; i++)
+		value = (value ^ uint64_t(str[i])) * prime_64_const;
+	return value;
+}
@@ -12,6 +12,23 @@ void add(double a, std::int32_t b)
 
 int main(int argc, char* argv[])
 {
+	// script precompile <file.bean>... writes a .beanc file next to every script.
+	if (argc >= 2 && std::string(argv[1]) == "precompile")
+	{
+		try {
+			for (auto i = 2; i < argc; i++)
+				std::cout << bean::precompile_file(argv[i]) << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "Exception occured while precompiling script." << std::endl;
+			std::cout << e.what() << std::endl;
+			return 1;
+		}
+
+		return 0;
+	}
+
 	int result = Catch::Session().run(argc, argv);
 	
 	auto token_gen = tokenizer();
@@ -0,0 +1,372 @@
+#pragma once
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bean_ast.hpp"
+#include "source_buffer.hpp"
+
+namespace bean {
+
+	// Reads and writes compiled scripts in a versioned binary format:
+	//
+	//   precompiled_header
+	//   flat_node[node_count]
+	//   precompiled_constant[constant_count]
+	//   precompiled_name[name_count]
+	//   std::uint32_t operands[operand_count]
+	//   std::uint32_t symbols[sum of symbol_counts]  name indices, grouped like symbol_counts
+	//   char text[text_size]                         bytes of all names
+	//
+	// Every section starts on an 8 byte boundary. Numbers are stored in host byte order, files are rejected
+	// on a host with the other order. Node records and operands are used straight from the mapped file, only
+	// the constants, the symbol table and the name views are rebuilt on load.
+	class precompiled
+	{
+	public:
+		static constexpr std::uint32_t version = 1;
+		static constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+		struct precompiled_header
+		{
+			char magic[4];
+			std::uint32_t version;
+			std::uint32_t byte_order;
+			std::uint32_t root;
+			std::uint32_t node_count;
+			std::uint32_t constant_count;
+			std::uint32_t name_count;
+			std::uint32_t operand_count;
+			// Defined variables, defined functions, external variables, external functions.
+			std::uint32_t symbol_counts[4];
+			std::uint32_t text_size;
+			std::uint32_t reserved[3];
+		};
+
+		struct precompiled_constant
+		{
+			std::uint32_t type;
+			std::uint32_t reserved;
+			union
+			{
+				std::int64_t integer;
+				double floating;
+			};
+		};
+
+		struct precompiled_name
+		{
+			std::uint32_t offset;
+			std::uint32_t length;
+		};
+
+		static_assert(sizeof(precompiled_header) == 64, "precompiled_header is part of the file format");
+		static_assert(sizeof(precompiled_constant) == 16, "precompiled_constant is part of the file format");
+
+		static void save(const compiled_script& script, std::ostream& output)
+		{
+			const auto& code = *script.get_code();
+			const auto& names = code.get_names();
+
+			if (code.lazy_count() != 0)
+				throw std::exception("Unable to precompile a script with unparsed function bodies.");
+
+			precompiled_header header{};
+			std::memcpy(header.magic, "BEAN", 4);
+			header.version = version;
+			header.byte_order = byte_order_mark;
+			header.root = code.get_root();
+			header.node_count = std::uint32_t(code.get_nodes().size());
+			header.constant_count = std::uint32_t(code.get_constants().size());
+			header.name_count = std::uint32_t(names.size());
+			header.operand_count = std::uint32_t(code.get_operands().size());
+
+			std::vector<precompiled_constant> constants;
+
+			for (const auto& constant : code.get_constants())
+			{
+				precompiled_constant record{};
+				record.type = std::uint32_t(constant.type());
+
+				if (constant.type() == BeanObjectType::INT)
+					record.integer = constant.as_int();
+				else if (constant.type() == BeanObjectType::DOUBLE)
+					record.floating = constant.as_double();
+				else
+					throw std::exception("Unable to precompile constant.");
+
+				constants.push_back(record);
+			}
+
+			std::vector<precompiled_name> name_records;
+			std::string text;
+
+			for (const auto name : names)
+			{
+				name_records.push_back({ std::uint32_t(text.size()), std::uint32_t(name.size()) });
+				text += name;
+			}
+
+			// Every symbol is also the name of a node, so symbols are stored as name indices.
+			std::vector<std::uint32_t> symbols;
+			const auto& table = script.get_symbols();
+			const std::set<std::string, std::less<>>* groups[4] = {
+				&table.get_defined(symbol_kind::variable), &table.get_defined(symbol_kind::function),
+				&table.get_external(symbol_kind::variable), &table.get_external(symbol_kind::function)
+			};
+
+			for (auto group = 0; group < 4; group++)
+			{
+				for (const auto& symbol : *groups[group])
+				{
+					const auto found = std::find(names.begin(), names.end(), symbol);
+
+					if (found == names.end())
+						throw std::exception("Unable to precompile symbol table.");
+
+					symbols.push_back(std::uint32_t(found - names.begin()));
+				}
+
+				header.symbol_counts[group] = std::uint32_t(groups[group]->size());
+			}
+
+			header.text_size = std::uint32_t(text.size());
+
+			write_section(output, &header, sizeof(header));
+			write_section(output, code.get_nodes().begin(), sizeof(flat_node) * header.node_count);
+			write_section(output, constants.data(), sizeof(precompiled_constant) * constants.size());
+			write_section(output, name_records.data(), sizeof(precompiled_name) * name_records.size());
+			write_section(output, code.get_operands().begin(), sizeof(std::uint32_t) * header.operand_count);
+			write_section(output, symbols.data(), sizeof(std::uint32_t) * symbols.size());
+			write_section(output, text.data(), text.size());
+		}
+
+		static void save_file(const compiled_script& script, const std::string& path)
+		{
+			std::ofstream output(path, std::ios::binary | std::ios::trunc);
+
+			if (!output)
+				throw std::exception("Unable to open precompiled script file for writing.");
+
+			save(script, output);
+		}
+
+		// The returned program keeps file alive, its nodes and operands are read from it directly.
+		static program load(const source_buffer_ptr& file)
+		{
+			reader in(file);
+
+			const auto& header = *in.section<precompiled_header>(1);
+
+			if (std::memcmp(header.magic, "BEAN", 4) != 0)
+				throw std::exception("Not a precompiled bean script.");
+
+			if (header.byte_order != byte_order_mark)
+				throw std::exception("Precompiled script was written on a host with a different byte order.");
+
+			if (header.version != version)
+				throw std::exception("Unsupported precompiled script version.");
+
+			const auto* nodes = in.section<flat_node>(header.node_count);
+			const auto* constants = in.section<precompiled_constant>(header.constant_count);
+			const auto* names = in.section<precompiled_name>(header.name_count);
+			const auto* operands = in.section<std::uint32_t>(header.operand_count);
+			const auto* symbols = in.section<std::uint32_t>(std::size_t(header.symbol_counts[0]) + header.symbol_counts[1] + header.symbol_counts[2] + header.symbol_counts[3]);
+			const auto* text = in.section<char>(header.text_size);
+
+			auto script = std::make_shared<compiled_script>();
+			auto code = std::make_shared<flat_ast>();
+
+			for (std::uint32_t i = 0; i < header.constant_count; i++)
+			{
+				if (constants[i].type == std::uint32_t(BeanObjectType::INT))
+					script->constants_.get_integer(std::int32_t(constants[i].integer));
+				else if (constants[i].type == std::uint32_t(BeanObjectType::DOUBLE))
+					script->constants_.get_double(constants[i].floating);
+				else
+					throw std::exception("Invalid constant in precompiled script.");
+			}
+
+			if (script->constants_.size() != header.constant_count)
+				throw std::exception("Duplicate constant in precompiled script.");
+
+			for (std::uint32_t i = 0; i < header.name_count; i++)
+			{
+				if (std::size_t(names[i].offset) + names[i].length > header.text_size)
+					throw std::exception("Invalid name in precompiled script.");
+
+				code->names_.emplace_back(text + names[i].offset, names[i].length);
+			}
+
+			// Externals go first, a name can be both used before and defined later in the same script.
+			const std::uint32_t* group = symbols;
+			const std::uint32_t* groups[4];
+
+			for (auto i = 0; i < 4; i++)
+			{
+				groups[i] = group;
+				group += header.symbol_counts[i];
+			}
+
+			const auto add_symbols = [&](const int index, const symbol_kind kind, const bool external)
+			{
+				for (std::uint32_t i = 0; i < header.symbol_counts[index]; i++)
+				{
+					if (groups[index][i] >= header.name_count)
+						throw std::exception("Invalid symbol in precompiled script.");
+
+					if (external)
+						script->symbols_.reference(code->names_[groups[index][i]], kind);
+					else
+						script->symbols_.define(code->names_[groups[index][i]], kind);
+				}
+			};
+
+			add_symbols(2, symbol_kind::variable, true);
+			add_symbols(3, symbol_kind::function, true);
+			add_symbols(0, symbol_kind::variable, false);
+			add_symbols(1, symbol_kind::function, false);
+
+			code->nodes_ = arena_array<const flat_node>(nodes, header.node_count);
+			code->operands_ = arena_array<const std::uint32_t>(operands, header.operand_count);
+			code->constants_ = script->constants_.get_constants();
+			code->root_ = header.root;
+			code->file_ = file;
+
+			validate(*code);
+			code->resolve_slots();
+
+			script->code_ = std::move(code);
+			return script;
+		}
+
+		static program load_file(const std::string& path)
+		{
+			return load(source_buffer::map_file(path));
+		}
+
+	private:
+		// Bounds checks every index in the records, so a damaged file throws instead of crashing the evaluator.
+		static void validate(const flat_ast& code)
+		{
+			const auto nodes = code.get_nodes();
+			const auto operand_count = code.get_operands().size();
+			const auto name_count = code.get_names().size();
+
+			if (nodes.empty() || code.get_root() >= nodes.size())
+				throw std::exception("Invalid root in precompiled script.");
+
+			for (std::uint32_t i = 0; i < nodes.size(); i++)
+			{
+				const auto& node = nodes[i];
+
+				auto valid = true;
+
+				// The evaluators index the names with node.name unchecked, for every kind that has a name.
+				switch (node.kind)
+				{
+				case flat_node_kind::integer:
+				case flat_node_kind::floating:
+				case flat_node_kind::define_var:
+				case flat_node_kind::variable_reference:
+				case flat_node_kind::define_and_set_var:
+				case flat_node_kind::set_var:
+				case flat_node_kind::function:
+				case flat_node_kind::lazy_function:
+				case flat_node_kind::call:
+					valid = node.name < name_count;
+					break;
+				default:
+					break;
+				}
+
+				switch (node.kind)
+				{
+				case flat_node_kind::integer:
+				case flat_node_kind::floating:
+					valid = valid && node.left < code.get_constants().size();
+					break;
+				case flat_node_kind::plus:
+				case flat_node_kind::minus:
+				case flat_node_kind::multiply:
+				case flat_node_kind::divide:
+				case flat_node_kind::pow:
+				case flat_node_kind::set_var:
+					valid = valid && node.left < i && node.right < i;
+					break;
+				case flat_node_kind::define_var:
+				case flat_node_kind::variable_reference:
+					break;
+				case flat_node_kind::ret:
+				case flat_node_kind::define_and_set_var:
+				case flat_node_kind::function:
+					valid = valid && node.left < i;
+					break;
+				case flat_node_kind::call:
+				case flat_node_kind::statement_list:
+					valid = valid && std::size_t(node.left) + node.right <= operand_count;
+
+					for (std::uint32_t entry = 0; valid && entry < node.right; entry++)
+						valid = code.get_operands()[node.left + entry] < i;
+					break;
+				default:
+					valid = false;
+					break;
+				}
+
+				if (!valid)
+					throw std::exception("Invalid node in precompiled script.");
+			}
+		}
+
+		static void write_section(std::ostream& output, const void* data, const std::size_t size)
+		{
+			static const char padding[8] = {};
+
+			output.write(static_cast<const char*>(data), std::streamsize(size));
+			output.write(padding, std::streamsize((8 - size % 8) % 8));
+		}
+
+		class reader
+		{
+		public:
+			explicit reader(const source_buffer_ptr& file) : data_(file->data()), size_(file->size()), offset_(0)
+			{
+				if (reinterpret_cast<std::uintptr_t>(data_) % alignof(flat_node) != 0)
+					throw std::exception("Precompiled script is not suitably aligned.");
+			}
+
+			template<typename T>
+			const T* section(const std::size_t count)
+			{
+				const auto size = sizeof(T) * count;
+
+				if (size > size_ - offset_)
+					throw std::exception("Precompiled script is truncated.");
+
+				const auto* result = reinterpret_cast<const T*>(data_ + offset_);
+				offset_ = std::min(size_, offset_ + size + (8 - size % 8) % 8);
+				return result;
+			}
+
+		private:
+			const char* data_;
+			std::size_t size_;
+			std::size_t offset_;
+		};
+	};
+
+	// Compiles a script file and writes it next to the source with a .beanc extension. Returns the path written.
+	inline std::string precompile_file(const std::string& path)
+	{
+		const auto source = source_buffer::map_file(path);
+		const auto script = ast_builder::compile(tokenizer::tokenize_stream(source));
+
+		const auto extension = path.rfind(".bean");
+		const auto output = extension != std::string::npos && extension + 5 == path.size() ? path + "c" : path + ".beanc";
+
+		precompiled::save_file(*script, output);
+		return output;
+	}
+
+}
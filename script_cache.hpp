@@ -0,0 +1,153 @@
+#pragma once
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "bean_ast.hpp"
+#include "fnv1a.hpp"
+
+namespace bean {
+
+	// Least recently used cache of compiled scripts keyed by a 64 bit fnv1a hash of their source. The source is
+	// kept next to each entry, so a hash collision is a miss rather than the wrong script.
+	class script_cache
+	{
+	public:
+		explicit script_cache(const std::size_t capacity = 1024) : capacity_(capacity)
+		{
+
+		}
+
+		// The index points into entries_, so a copy rebuilds it against its own list. Moving a list keeps its iterators.
+		script_cache(const script_cache& other) : capacity_(other.capacity_), entries_(other.entries_), hits_(other.hits_), misses_(other.misses_)
+		{
+			reindex();
+		}
+
+		script_cache(script_cache&&) = default;
+
+		script_cache& operator=(const script_cache& other)
+		{
+			if (this != &other)
+			{
+				capacity_ = other.capacity_;
+				entries_ = other.entries_;
+				hits_ = other.hits_;
+				misses_ = other.misses_;
+				reindex();
+			}
+
+			return *this;
+		}
+
+		script_cache& operator=(script_cache&&) = default;
+
+		static std::uint64_t hash(const std::string_view source)
+		{
+			return hash_64_fnv1a(source.data(), source.size());
+		}
+
+		// The cached script for source, marked as most recently used, or nullptr.
+		program find(const std::string_view source)
+		{
+			const auto found = index_.find(hash(source));
+
+			if (found == index_.end() || found->second->source != source)
+			{
+				misses_++;
+				return nullptr;
+			}
+
+			entries_.splice(entries_.begin(), entries_, found->second);
+			hits_++;
+
+			return found->second->script;
+		}
+
+		void insert(const std::string_view source, program script)
+		{
+			if (capacity_ == 0)
+				return;
+
+			const auto key = hash(source);
+			const auto found = index_.find(key);
+
+			if (found != index_.end())
+			{
+				entries_.erase(found->second);
+				index_.erase(found);
+			}
+
+			entries_.push_front({ key, std::string(source), std::move(script) });
+			index_.emplace(key, entries_.begin());
+
+			evict();
+		}
+
+		// Shrinking the capacity evicts the least recently used entries, 0 disables caching.
+		void set_capacity(const std::size_t capacity)
+		{
+			capacity_ = capacity;
+			evict();
+		}
+
+		[[nodiscard]] std::size_t get_capacity() const
+		{
+			return capacity_;
+		}
+
+		[[nodiscard]] std::size_t size() const
+		{
+			return entries_.size();
+		}
+
+		[[nodiscard]] std::uint64_t hits() const
+		{
+			return hits_;
+		}
+
+		[[nodiscard]] std::uint64_t misses() const
+		{
+			return misses_;
+		}
+
+		void clear()
+		{
+			entries_.clear();
+			index_.clear();
+		}
+
+	private:
+		void reindex()
+		{
+			index_.clear();
+
+			for (auto it = entries_.begin(); it != entries_.end(); ++it)
+				index_.emplace(it->key, it);
+		}
+
+		void evict()
+		{
+			while (entries_.size() > capacity_)
+			{
+				index_.erase(entries_.back().key);
+				entries_.pop_back();
+			}
+		}
+
+		struct entry
+		{
+			std::uint64_t key;
+			std::string source;
+			program script;
+		};
+
+		std::size_t capacity_;
+		std::list<entry> entries_;
+		std::unordered_map<std::uint64_t, std::list<entry>::iterator> index_;
+		std::uint64_t hits_ = 0;
+		std::uint64_t misses_ = 0;
+	};
+
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <string_view>
+#include <fstream>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class source_buffer;
+
+using source_buffer_ptr = std::shared_ptr<const source_buffer>;
+
+// Owns the bytes of a script. Tokens only hold views into it, so the text is stored once no matter how
+// many tokens, token_arrays or token_iterators are created from it. The bytes either live in a string
+// or in a read only mapping of a script file.
+class source_buffer
+{
+public:
+	explicit source_buffer(std::string text) : text_(std::move(text)), data_(text_.data()), size_(text_.size())
+	{
+
+	}
+
+	source_buffer(const source_buffer&) = delete;
+	source_buffer& operator=(const source_buffer&) = delete;
+
+	~source_buffer()
+	{
+		if (!mapped_)
+			return;
+
+#if defined(_WIN32)
+		UnmapViewOfFile(data_);
+#else
+		munmap(const_cast<char*>(data_), size_);
+#endif
+	}
+
+	static source_buffer_ptr create(std::string text)
+	{
+		return std::make_shared<const source_buffer>(std::move(text));
+	}
+
+	// Maps a script file into memory so the lexer reads it straight from the page cache. Empty files can
+	// not be mapped and are returned as an empty buffer.
+	static source_buffer_ptr map_file(const std::string& path)
+	{
+#if defined(_WIN32)
+		const auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::exception("Unable to open script file.");
+
+		LARGE_INTEGER file_size;
+
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return create("");
+		}
+
+		const auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		const auto* view = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+
+		// The view keeps the mapping alive on its own.
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+
+		if (!view)
+			throw std::exception("Unable to map script file.");
+
+		return source_buffer_ptr(new source_buffer(view, std::size_t(file_size.QuadPart)));
+#else
+		const auto file = open(path.c_str(), O_RDONLY);
+
+		if (file < 0)
+			throw std::exception("Unable to open script file.");
+
+		struct stat file_stat {};
+
+		if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0)
+		{
+			close(file);
+			return create("");
+		}
+
+		const auto size = std::size_t(file_stat.st_size);
+		auto* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+
+		// The mapping stays valid after the descriptor is closed.
+		close(file);
+
+		if (view == MAP_FAILED)
+			throw std::exception("Unable to map script file.");
+
+		madvise(view, size, MADV_SEQUENTIAL);
+
+		return source_buffer_ptr(new source_buffer(static_cast<const char*>(view), size));
+#endif
+	}
+
+	// Reads the rest of a stream with a single sized read, for sources that can not be mapped.
+	static source_buffer_ptr read_stream(std::ifstream& file)
+	{
+		const auto start = file.tellg();
+		file.seekg(0, std::ios::end);
+		const auto end = file.tellg();
+		file.seekg(start);
+
+		if (start < 0 || end <= start)
+			return create("");
+
+		std::string text(std::size_t(end - start), '\0');
+		file.read(text.data(), std::streamsize(text.size()));
+		text.resize(std::size_t(file.gcount()));
+
+		return create(std::move(text));
+	}
+
+	[[nodiscard]] std::string_view view() const
+	{
+		return std::string_view(data_, size_);
+	}
+
+	[[nodiscard]] const char* data() const
+	{
+		return data_;
+	}
+
+	[[nodiscard]] std::size_t size() const
+	{
+		return size_;
+	}
+
+	[[nodiscard]] bool is_mapped() const
+	{
+		return mapped_;
+	}
+
+private:
+	source_buffer(const char* mapped_data, const std::size_t mapped_size) : data_(mapped_data), size_(mapped_size), mapped_(true)
+	{
+
+	}
+
+	std::string text_;
+	const char* data_;
+	std::size_t size_;
+	bool mapped_ = false;
+};
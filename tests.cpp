@@ -3,10 +3,85 @@
 #include "catch.hpp"
 #include "bean_ast.hpp"
 #include "bean_vm.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <future>
+#include <new>
 
 using namespace bean;
 
-static std::pair<bean_state, std::shared_ptr<bean_object>> eval_simple_all(const std::string script)
+// Counts heap allocations, so tests can check that a code path does not allocate. Every plain, array and nothrow
+// form is replaced so that no allocation is released by a different allocator than the one that made it; the aligned
+// forms are left to the library. Both halves stay out of line, so the compiler never sees memory from a new
+// expression handed straight to free.
+static std::atomic<std::size_t> allocation_count{ 0 };
+
+BEAN_NOINLINE static void* counted_allocate(const std::size_t size) noexcept
+{
+	allocation_count++;
+	return std::malloc(size == 0 ? 1 : size);
+}
+
+BEAN_NOINLINE static void counted_deallocate(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void* operator new(const std::size_t size)
+{
+	if (auto* memory = counted_allocate(size))
+		return memory;
+
+	throw std::bad_alloc();
+}
+
+void* operator new[](const std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(const std::size_t size, const std::nothrow_t&) noexcept
+{
+	return counted_allocate(size);
+}
+
+void* operator new[](const std::size_t size, const std::nothrow_t&) noexcept
+{
+	return counted_allocate(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	counted_deallocate(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	counted_deallocate(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	counted_deallocate(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+	counted_deallocate(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+	counted_deallocate(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+	counted_deallocate(memory);
+}
+
+static std::pair<bean_state, bean_value> eval_simple_all(const std::string script)
 {
 	auto vm = bean_vm();
 	auto& state = vm.get_state();
@@ -14,7 +89,7 @@ static std::pair<bean_state, std::shared_ptr<bean_object>> eval_simple_all(const
 	return std::make_pair(state, res);
 }
 
-static std::shared_ptr<bean_object> eval_simple(const std::string script)
+static bean_value eval_simple(const std::string script)
 {
 	return eval_simple_all(script).second;
 }
@@ -24,129 +99,1425 @@ bool are_same(double a, double b) {
 	return std::fabs(a - b) < std::numeric_limits<double>::epsilon();
 }
 
-TEST_CASE("VM")
+// The original line splitting tokenizer, which retries every delimiter at every byte of the rest of the line.
+// Kept as a reference for the single pass lexer.
+static token_array tokenize_reference(const std::string& raw_input)
 {
-	SECTION("Mathmatical Expressions") {
+	const std::vector<std::pair<std::string, token_type>> delims = {
+		{" ", token_type::space}, {",", token_type::comma}, {"(", token_type::lparen}, {")", token_type::rparen},
+		{"{", token_type::lbrace}, {"}", token_type::rbrace}, {"[", token_type::lbracket}, {"]", token_type::rbracket},
+		{":", token_type::colon}, {";", token_type::semicolon}, {"=", token_type::equal}, {"*", token_type::asterisk},
+		{"\r", token_type::carriagereturn}, {"+", token_type::plus}, {"-", token_type::minus}, {"/", token_type::forward_slash},
+		{"^", token_type::carrot}, {"pow", token_type::pow}
+	};
 
-		SECTION("Testing return types of mathmatical expressions.")
+	const auto source = source_buffer::create(raw_input);
+	token_array output(source);
+	std::uint32_t line_number = 1;
+	std::size_t line_offset = 0;
+
+	for (auto& line : split_string(raw_input, "\n"))
+	{
+		const auto text = [&](const std::size_t pos, const std::size_t length)
+		{
+			return source->view().substr(line_offset + pos, length);
+		};
+
+		const auto emit_symbol = [&](const std::size_t pos, const std::size_t length)
 		{
-			REQUIRE(eval_simple("3")->type() == BeanObjectType::INT);
-			REQUIRE(eval_simple("3.0")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.5")->type() == BeanObjectType::DOUBLE);
+			token_value value{};
+			const auto type = tokenizer::classify_symbol(text(pos, length), value);
+			output.emplace_back(std::uint32_t(pos), line_number, type, text(pos, length), value);
+		};
 
-			REQUIRE(eval_simple("3 + 10")->type() == BeanObjectType::INT);
-			REQUIRE(eval_simple("3.0 + 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3 + 10.0")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 + 10.0")->type() == BeanObjectType::DOUBLE);
+		std::size_t last_token_end_pos = 0;
 
+		while (last_token_end_pos < line.length())
+		{
+			const auto rest = line.substr(last_token_end_pos);
+			std::size_t found_pos = std::string::npos;
+			const std::pair<std::string, token_type>* found_delim = nullptr;
 
-			REQUIRE(eval_simple("3 - 10")->type() == BeanObjectType::INT);
-			REQUIRE(eval_simple("3.0 - 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3 - 10.0")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 - 10.0")->type() == BeanObjectType::DOUBLE);
+			for (std::size_t i = 0; i < rest.length() && !found_delim; i++)
+			{
+				for (const auto& delim : delims)
+				{
+					if (rest.compare(i, delim.first.length(), delim.first) == 0)
+					{
+						found_pos = last_token_end_pos + i;
+						found_delim = &delim;
+						break;
+					}
+				}
+			}
 
-			REQUIRE(eval_simple("3 * 10")->type() == BeanObjectType::INT);
-			REQUIRE(eval_simple("3.0 * 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3 * 10.0")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 * 10.0")->type() == BeanObjectType::DOUBLE);
+			if (!found_delim)
+			{
+				emit_symbol(last_token_end_pos, rest.length());
+				break;
+			}
 
-			REQUIRE(eval_simple("3 / 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 / 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3 / 10.0")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 / 10.0")->type() == BeanObjectType::DOUBLE);
+			if (found_pos > last_token_end_pos)
+				emit_symbol(last_token_end_pos, found_pos - last_token_end_pos);
 
-			REQUIRE(eval_simple("3 ^ 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 ^ 10")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3 ^ 10.0")->type() == BeanObjectType::DOUBLE);
-			REQUIRE(eval_simple("3.0 ^ 10.0")->type() == BeanObjectType::DOUBLE);
+			output.emplace_back(std::uint32_t(found_pos), line_number, found_delim->second, text(found_pos, found_delim->first.length()));
+			last_token_end_pos = found_pos + found_delim->first.length();
 		}
 
-		SECTION("Testing correctness of mathmatical operators.")
-		{
-			REQUIRE(eval_simple("3")->as_int() == 3);
-			REQUIRE(are_same(eval_simple("3.0")->as_double(), 3.0));
-			REQUIRE(are_same(eval_simple("3.5")->as_double(), 3.5));
+		line_number++;
+		line_offset += line.length() + 1;
+	}
 
-			REQUIRE(eval_simple("3 + 10")->as_int() == 13);
-			REQUIRE(are_same(eval_simple("3.0 + 10")->as_double(), 13.0));
-			REQUIRE(are_same(eval_simple("3 + 10.0")->as_double(), 13.0));
-			REQUIRE(are_same(eval_simple("3.0 + 10.0")->as_double(), 13.0));
+	return output;
+}
 
+static bool same_tokens(const token_array& a, const token_array& b)
+{
+	return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const token& l, const token& r)
+	{
+		if (l.get_type() != r.get_type() || l.get_text() != r.get_text() || l.get_pos() != r.get_pos() || l.get_line() != r.get_line())
+			return false;
 
-			REQUIRE(eval_simple("3 - 10")->as_int() == -7);
-			REQUIRE(are_same(eval_simple("3.0 - 10")->as_double(), -7.0));
-			REQUIRE(are_same(eval_simple("3 - 10.0")->as_double(), -7.0));
-			REQUIRE(are_same(eval_simple("3.0 - 10.0")->as_double(), -7.0));
+		if (l.get_type() == token_type::integer_literal)
+			return l.get_integer() == r.get_integer();
 
-			REQUIRE(eval_simple("3 * 10")->as_int() == 30);
-			REQUIRE(are_same(eval_simple("3.0 * 10")->as_double(), 30.0));
-			REQUIRE(are_same(eval_simple("3 * 10.0")->as_double(), 30.0));
-			REQUIRE(are_same(eval_simple("3.0 * 10.0")->as_double(), 30.0));
+		if (l.get_type() == token_type::double_literal)
+			return l.get_double() == r.get_double();
 
-			// all division results in a floating point value.
-			REQUIRE(are_same(eval_simple("10 / 2")->as_double(), 5.0));
-			REQUIRE(are_same(eval_simple("3 / 10")->as_double(), double(3) / double(10)));
-			REQUIRE(are_same(eval_simple("3.0 / 10")->as_double(), double(3) / double(10)));
-			REQUIRE(are_same(eval_simple("3 / 10.0")->as_double(), double(3) / double(10)));
-			REQUIRE(are_same(eval_simple("3.0 / 10.0")->as_double(), double(3) / double(10)));
+		return true;
+	});
+}
 
-			// all pow results in a floating point value.
-			REQUIRE(are_same(eval_simple("2 ^ 2")->as_double(), 4.0));
-			REQUIRE(are_same(eval_simple("3 ^ 10")->as_double(), 59049.0));
-			REQUIRE(are_same(eval_simple("3.0 ^ 10")->as_double(), 59049.0));
-			REQUIRE(are_same(eval_simple("3 ^ 10.0")->as_double(), 59049.0));
-			REQUIRE(are_same(eval_simple("3.0 ^ 10.0")->as_double(), 59049.0));
-		}
+static std::string generate_script(const std::size_t statements, const bool single_line)
+{
+	std::stringstream script;
 
-		SECTION("Ensuring any ammount of spaces seperating operators is allowed and does not affect the output.") {
-			REQUIRE(eval_simple("   3")->as_int() == 3);
-			REQUIRE(eval_simple("3    ")->as_int() == 3);
-			REQUIRE(eval_simple("   3   ")->as_int() == 3);
-			REQUIRE(eval_simple(" 3  ")->as_int() == 3);
-			REQUIRE(eval_simple("  3    ")->as_int() == 3);
+	for (std::size_t i = 0; i < statements; i++)
+	{
+		script << "var v" << i << " = (v" << i << " + 2.5) * 3 - 4 / 2 ^ 2;";
+
+		if (!single_line)
+			script << "\r\n";
+	}
+
+	return script.str();
+}
+
+// Library of independent functions, each a few statements long.
+static std::string generate_library(const std::size_t functions)
+{
+	std::stringstream script;
+
+	for (std::size_t i = 0; i < functions; i++)
+		script << "fun f" << i << " {\r\n    var a = " << i << " * 2 + 1;\r\n    var b = a ^ 2 - a / 3;\r\n    return a + b * (a - 4)\r\n}\r\n";
+
+	return script.str();
+}
 
-			REQUIRE(eval_simple(" 1  +3")->as_int() == 4);
-			REQUIRE(eval_simple("3  +1  ")->as_int() == 4);
+TEST_CASE("Tokenizer")
+{
+	SECTION("Single pass lexer matches the reference tokenizer")
+	{
+		const std::vector<std::string> scripts = {
+			"",
+			"3",
+			"   3   ",
+			"(4 + 5 * (2 + 3) * 5) * 5 * (4/3)",
+			"fun get_pi_approx { var pi = 22 / 7; return pi; }",
+			"var x = 2pow3;\r\nvar y = [x, x]:x;\n\n\treturn y;\n",
+			"a+b\nc-d\n",
+			generate_script(50, false)
+		};
+
+		for (const auto& script : scripts)
+		{
+			REQUIRE(same_tokens(tokenizer::tokenize(script), tokenize_reference(script)));
 		}
+	}
 
-		SECTION("Order of ops sans parentheses") {
-			REQUIRE(are_same(eval_simple("3 + 3 * 6")->as_int(), 21));
-			REQUIRE(are_same(eval_simple("3 + 2 * 4")->as_int(), 11));
-			REQUIRE(are_same(eval_simple("3+2-1")->as_int(), 4));
-			REQUIRE(are_same(eval_simple("7+4*9-1")->as_int(), 42));
-			REQUIRE(are_same(eval_simple("9 * 7 / 4")->as_double(), 15.75));
+	SECTION("Multi character operators")
+	{
+		const auto tokens = tokenizer::tokenize("xpowy");
+
+		REQUIRE(tokens.size() == 3);
+		REQUIRE(tokens[0].get_text() == "x");
+		REQUIRE(tokens[1].get_type() == token_type::pow);
+		REQUIRE(tokens[2].get_text() == "y");
+		REQUIRE(tokens[2].get_pos() == 4);
+	}
+
+	SECTION("Keywords and literals")
+	{
+		const auto tokens = tokenizer::tokenize("fun var return function 42 2.5 .5 1e3 99999999999 2x 0x10 0X1.8p1 0x nan INF");
+
+		const std::vector<token_type> expected = {
+			token_type::kw_fun, token_type::kw_var, token_type::kw_return, token_type::symbol, token_type::integer_literal,
+			token_type::double_literal, token_type::double_literal, token_type::double_literal, token_type::double_literal,
+			token_type::symbol, token_type::double_literal, token_type::double_literal, token_type::symbol, token_type::symbol,
+			token_type::symbol
+		};
+
+		token_iterator iterator(tokens);
+		REQUIRE(iterator.size() == expected.size());
+
+		for (std::uint32_t i = 0; i < expected.size(); i++)
+			REQUIRE(iterator.get_type(i) == expected[i]);
+
+		REQUIRE(iterator.get_or_invalid(4).get_integer() == 42);
+		REQUIRE(iterator.get_or_invalid(5).get_double() == 2.5);
+		REQUIRE(iterator.get_or_invalid(7).get_double() == 1000.0);
+
+		// Hexadecimal doubles are read like strtod reads them.
+		REQUIRE(iterator.get_or_invalid(10).get_double() == 16.0);
+		REQUIRE(iterator.get_or_invalid(11).get_double() == 3.0);
+	}
+
+	SECTION("Token stream holds the same tokens as token_array")
+	{
+		const auto script = generate_script(20, false);
+		const auto stream = tokenizer::tokenize_stream(script);
+
+		REQUIRE(same_tokens(stream.to_token_array(), tokenizer::tokenize(script)));
+		REQUIRE(stream.find_first_of(token_type::semicolon) == 29);
+		REQUIRE(stream.find_first_of(token_type::semicolon, 30) == 60);
+
+		token_iterator iterator(stream);
+		REQUIRE(iterator.get_type(iterator.find_first_of(token_type::lparen)) == token_type::lparen);
+		REQUIRE(iterator.find_last_pos_of_open_close(token_type::lparen, token_type::rparen) == 7);
+	}
+
+	SECTION("Every structural indexing level the cpu supports produces the same tokens")
+	{
+		const auto script = source_buffer::create(generate_script(37, false) + "xpowy ppow powpow\n\ttail");
+		const auto expected = tokenize_reference(std::string(script->view()));
+
+		for (auto level = int(simd_level::scalar); level <= int(structural_indexer::best()); level++)
+		{
+			REQUIRE(same_tokens(tokenizer::tokenize_stream(script, simd_level(level)).to_token_array(), expected));
 		}
+	}
 
-		SECTION("Parentheses", "[parentheses]") {
-			REQUIRE(are_same(eval_simple("(3)")->as_int(), 3));
-			REQUIRE(are_same(eval_simple("((3))")->as_int(), 3));
-			REQUIRE(are_same(eval_simple("(((3)))")->as_int(), 3));
-			REQUIRE(are_same(eval_simple("(3 + 2) * 4")->as_int(), 20));
-			REQUIRE(are_same(eval_simple("((3 + 2) * 4)")->as_int(), 20));
-			REQUIRE(are_same(eval_simple("(4 + 5 * (2 + 3) * 5) * 5 * (4/3)")->as_double(), 860));
+	SECTION("Token iterator slices are views over one stream")
+	{
+		token_iterator iterator(tokenizer::tokenize_stream("var x = ((1 + 2)); var y = (3) * (4);"));
+		const auto statements = iterator.split(token_type::semicolon);
+
+		REQUIRE(statements.size() == 3);
+		REQUIRE(&statements[0].get_stream() == &iterator.get_stream());
+
+		auto body = statements[0].splice(3, std::uint32_t(statements[0].size()));
+		REQUIRE(body.size() == 7);
+		REQUIRE(body.find_first_of(token_type::semicolon) == invalid_token_index);
+
+		ast_builder::remove_first_last_token(body, token_type::lparen, token_type::rparen);
+		REQUIRE(body.size() == 3);
+		REQUIRE(body.first().get_integer() == 1);
+		REQUIRE(&body.get_stream() == &iterator.get_stream());
+
+		auto product = iterator.splice(14, 21);
+		REQUIRE(product.first().get_type() == token_type::lparen);
+		REQUIRE(product.last().get_type() == token_type::rparen);
+
+		ast_builder::remove_first_last_token(product, token_type::lparen, token_type::rparen);
+		REQUIRE(product.size() == 7);
+
+		product.remove(3);
+		REQUIRE(product.get_type(3) == token_type::lparen);
+		REQUIRE(iterator.get_type(17) == token_type::asterisk);
+	}
+
+	SECTION("Bracket match table")
+	{
+		const auto stream = tokenizer::tokenize_stream("fun f {(a)}(b}{");
+
+		// fun, space, f, space, {, (, a, ), }, (, b, }, {
+		REQUIRE(stream.get_match(4) == 8);
+		REQUIRE(stream.get_match(8) == 4);
+		REQUIRE(stream.get_match(5) == 7);
+		REQUIRE(stream.get_match(7) == 5);
+		REQUIRE(stream.get_match(9) == invalid_token_index);
+		REQUIRE(stream.get_match(11) == invalid_token_index);
+		REQUIRE(stream.get_match(12) == invalid_token_index);
+		REQUIRE(stream.get_match(6) == invalid_token_index);
+
+		std::string nested;
+		for (auto i = 0; i < 500; i++)
+			nested += "( ";
+		nested += "1";
+		for (auto i = 0; i < 500; i++)
+			nested += " )";
+
+		token_iterator iterator(tokenizer::tokenize_stream(nested));
+		REQUIRE(iterator.get_match(0) == 1000);
+		REQUIRE(iterator.splice(1, 1000).get_match(0) == 998);
+		REQUIRE(iterator.splice(0, 1000).get_match(0) == invalid_token_index);
+
+		ast_builder::remove_first_last_token(iterator, token_type::lparen, token_type::rparen);
+		REQUIRE(iterator.size() == 1);
+
+		token_iterator groups(tokenizer::tokenize_stream("(1) + (2)"));
+		ast_builder::remove_first_last_token(groups, token_type::lparen, token_type::rparen);
+		REQUIRE(groups.size() == 7);
+		REQUIRE(groups.find_rightmost_of(token_type::plus) == 3);
+	}
+
+	SECTION("Token text is a view into the shared source buffer")
+	{
+		const auto source = source_buffer::create("var x = (1 + 2);");
+		auto tokens = tokenizer::tokenize(source);
+
+		for (const auto& tok : tokens)
+		{
+			REQUIRE(tok.get_text().data() >= source->data());
+			REQUIRE(tok.get_text().data() + tok.get_text().size() <= source->data() + source->size());
 		}
 
+		// Slices of the token stream keep the buffer alive on their own.
+		token_iterator iterator(tokens);
+		auto rest = iterator.splice(2, iterator.size());
+		tokens = token_array();
+
+		REQUIRE(rest.first().get_text() == "=");
+		REQUIRE(rest.get_tokens().get_source() == source);
 	}
+}
 
-	SECTION("Variables")
+TEST_CASE("Tokenizer scaling", "[!benchmark]")
+{
 	{
+		const auto script = source_buffer::create(generate_script(100000, false));
+
+		for (auto level = int(simd_level::scalar); level <= int(structural_indexer::best()); level++)
 		{
-			auto [state, result] = eval_simple_all("var x = (1 + 2);");
-			REQUIRE(state.variables.size() == 1);
-			REQUIRE(state.variables.count("x") == 1);
-			REQUIRE(state.variables["x"]->as_int() == 3);
+			BENCHMARK("structural indexing level " + std::to_string(level) + ", " + std::to_string(script->size() >> 20) + " MiB script")
+			{
+				return tokenizer::tokenize_stream(script, simd_level(level));
+			};
 		}
+	}
+
+	for (const std::size_t statements : { 100, 400, 1600 })
+	{
+		const auto script = generate_script(statements, true);
 
+		BENCHMARK("reference tokenizer, " + std::to_string(statements) + " statements on one line")
 		{
-			auto [state, result] = eval_simple_all("var x = (1 + 2); var y = x + 1;");
-			
-			REQUIRE(state.variables.size() == 2);
-			
-			REQUIRE(state.variables.count("x") == 1);
-			REQUIRE(state.variables["x"]->as_int() == 3);
+			return tokenize_reference(script);
+		};
 
-			REQUIRE(state.variables.count("y") == 1);
-			REQUIRE(state.variables["y"]->as_int() == 4);
+		BENCHMARK("single pass lexer, " + std::to_string(statements) + " statements on one line")
+		{
+			return tokenizer::tokenize(script);
+		};
+	}
+}
+
+TEST_CASE("Parser scaling", "[!benchmark]")
+{
+	for (const std::size_t statements : { 2500, 10000, 40000 })
+	{
+		const auto tokens = tokenizer::tokenize_stream(generate_script(statements, false));
+
+		BENCHMARK("parse " + std::to_string(tokens.size()) + " tokens")
+		{
+			return ast_builder::compile(tokens);
+		};
+	}
+}
+
+TEST_CASE("Compiled script cache", "[!benchmark]")
+{
+	const std::string script = "var result = (3 + 4 * 2.5) ^ 2 - 8 / 4;";
+
+	for (const std::size_t capacity : { 0, 1024 })
+	{
+		auto vm = bean_vm();
+		vm.set_cache_capacity(capacity);
+
+		BENCHMARK("eval_result, cache capacity " + std::to_string(capacity))
+		{
+			return vm.eval_result(script);
+		};
+	}
+}
+
+TEST_CASE("Precompiled load", "[!benchmark]")
+{
+	const std::string path = "bean_bench_precompiled.bean";
+
+	{
+		std::ofstream file(path, std::ios::binary);
+		file << generate_script(40000, false);
+	}
+
+	const auto output = precompile_file(path);
+
+	BENCHMARK("compile from source")
+	{
+		return ast_builder::compile(tokenizer::tokenize_stream(source_buffer::map_file(path)));
+	};
+
+	BENCHMARK("load precompiled")
+	{
+		return precompiled::load_file(output);
+	};
+
+	std::remove(path.c_str());
+	std::remove(output.c_str());
+}
+
+TEST_CASE("Parallel function parsing", "[!benchmark]")
+{
+	// About 60k lines.
+	const auto tokens = tokenizer::tokenize_stream(generate_library(12000));
+
+	for (const std::size_t threads : { 1, 2, 4, 8 })
+	{
+		thread_pool pool(threads);
+
+		BENCHMARK("compile on " + std::to_string(threads) + " threads")
+		{
+			return ast_builder::compile(tokens, pool);
+		};
+	}
+}
+
+TEST_CASE("Variable access", "[!benchmark]")
+{
+	// Reads and writes of a few variables among many, from flat code.
+	std::string globals;
+
+	for (auto i = 0; i < 1000; i++)
+		globals += "var g" + std::to_string(i) + " = " + std::to_string(i) + ";";
+
+	auto vm = bean_vm();
+	vm.eval(globals);
+
+	const auto program = vm.compile("g10 = g500 + g999 - g10; g500 = g10 * g1 + g2; g999 = g500 - g10;");
+
+	BENCHMARK("read and write 1000 globals")
+	{
+		return vm.run(program);
+	};
+}
+
+TEST_CASE("Function calls", "[!benchmark]")
+{
+	std::function<std::int32_t(std::int32_t)> native = [](std::int32_t value) { return value + 1; };
+
+	auto vm = bean_vm();
+	vm.bind_function("native", native);
+
+	// Many functions bound, so resolving a name is not trivially cheap.
+	for (auto i = 0; i < 200; i++)
+		vm.eval("fun helper" + std::to_string(i) + " { return " + std::to_string(i) + " }");
+
+	std::string calls = "var total = 0;";
+
+	for (auto i = 0; i < 100; i++)
+		calls += "total = total + helper" + std::to_string(i % 200) + "() + native(1);";
+
+	const auto program = vm.compile(calls);
+
+	BENCHMARK("200 calls")
+	{
+		return vm.run(program);
+	};
+}
+
+TEST_CASE("Bytecode VM", "[!benchmark]")
+{
+	std::function<std::int32_t(std::int32_t, std::int32_t)> add_two_ints = [](std::int32_t a, std::int32_t b) {
+		return a + b;
+	};
+
+	const std::vector<std::pair<std::string, std::string>> scripts = {
+		{ "arithmetic", "var x = 3; var y = 2.5; var z = (x + y) * (x - y) / 2 ^ 2 + x * 4 - y / 5; z = z * 2 + x - (y + 1) * (z - x); z" },
+		{ "function calls", "var n = 1; fun inc { n = n + 1; return n } fun twice { return inc() + inc() } fun four { return twice() + twice() } four() + four() + add_two_ints(four(), 2)" }
+	};
+
+	for (const auto& [name, source] : scripts)
+	{
+		auto vm = bean_vm();
+		vm.bind_function("add_two_ints", add_two_ints);
+
+		const auto tokens = tokenizer::tokenize_stream(source);
+		const auto script = ast_builder::compile(tokens, vm.get_state());
+		const auto& bytecode = *script->get_bytecode();
+
+		// The tree walker sees the functions the script defines through its own nodes.
+		BENCHMARK(name + ", tree walker")
+		{
+			return script->get_root()->eval(vm.get_state());
+		};
+
+		BENCHMARK(name + ", flat code")
+		{
+			return script->eval(vm.get_state());
+		};
+
+		BENCHMARK(name + ", bytecode")
+		{
+			return bean_vm::execute(vm.get_state(), bytecode);
+		};
+	}
+}
+
+TEST_CASE("Arithmetic dispatch", "[!benchmark]")
+{
+	const std::vector<std::pair<bean_value, bean_value>> operands = { { bean_value(3), bean_value(4) }, { bean_value(3), bean_value(2.5) }, { bean_value(1.5), bean_value(2.5) } };
+
+	std::vector<std::pair<bean_object_ptr, bean_object_ptr>> boxed;
+
+	for (const auto& [lh, rh] : operands)
+		boxed.emplace_back(lh.to_object(), rh.to_object());
+
+	// The virtual methods the table replaced, on boxed numbers.
+	BENCHMARK("virtual lh_plus")
+	{
+		std::int32_t types = 0;
+
+		for (const auto& [lh, rh] : boxed)
+			types += std::int32_t(lh->lh_plus(rh)->type());
+
+		return types;
+	};
+
+	BENCHMARK("operator table")
+	{
+		std::int32_t types = 0;
+
+		for (const auto& [lh, rh] : operands)
+			types += std::int32_t(lh.lh_plus(rh).type());
+
+		return types;
+	};
+}
+
+TEST_CASE("Quickening", "[!benchmark]")
+{
+	auto vm = bean_vm();
+
+	const auto script = vm.compile("var a = 3; var b = 4; var c = 1.5; var d = 2.25; var r = (a + b) * (a - b) + a * b - b; var s = (c + d) * (c - d) / d + c * d; r");
+	const auto& code = script->get_code();
+
+	// A new program per run, so every arithmetic instruction is still generic.
+	BENCHMARK_ADVANCED("generic")(Catch::Benchmark::Chronometer meter)
+	{
+		std::vector<std::shared_ptr<const bytecode_program>> programs;
+
+		for (auto i = 0; i < meter.runs(); i++)
+			programs.push_back(bytecode_program::compile(code));
+
+		meter.measure([&](const int run) { return bean_vm::execute(vm.get_state(), *programs[run]); });
+	};
+
+	const auto quickened = bytecode_program::compile(code);
+
+	for (auto i = 0; i < bytecode_program::quickening_threshold; i++)
+		bean_vm::execute(vm.get_state(), *quickened);
+
+	BENCHMARK("quickened")
+	{
+		return bean_vm::execute(vm.get_state(), *quickened);
+	};
+}
+
+TEST_CASE("Bytecode dispatch", "[!benchmark]")
+{
+	const std::vector<std::pair<std::string, std::string>> scripts = {
+		{ "arithmetic", "var x = 3; var y = 2.5; var z = (x + y) * (x - y) / 2 ^ 2 + x * 4 - y / 5; z = z * 2 + x - (y + 1) * (z - x); z" },
+		{ "function calls", "var n = 1; fun inc { n = n + 1; return n } fun twice { return inc() + inc() } fun four { return twice() + twice() } four() + four()" }
+	};
+
+	for (const auto& [name, source] : scripts)
+	{
+		auto vm = bean_vm();
+
+		const auto script = vm.compile(source);
+		const auto& bytecode = *script->get_bytecode();
+
+		BENCHMARK(name + ", switch")
+		{
+			return bean_vm::execute<dispatch_mode::switch_table>(vm.get_state(), bytecode);
+		};
+
+#if BEAN_THREADED_DISPATCH
+		BENCHMARK(name + ", threaded")
+		{
+			return bean_vm::execute<dispatch_mode::threaded>(vm.get_state(), bytecode);
+		};
+#endif
+	}
+}
+
+TEST_CASE("Lazy function bodies", "[!benchmark]")
+{
+	// A library of 2000 functions where the script only calls one.
+	const auto library = generate_library(2000) + "return f7();";
+
+	const auto tokens = std::make_shared<const token_stream>(tokenizer::tokenize_stream(library));
+
+	for (const auto lazy : { false, true })
+	{
+		BENCHMARK(std::string(lazy ? "lazy" : "eager") + " compile and run")
+		{
+			auto vm = bean_vm();
+			return vm.run(ast_builder::compile(tokens, lazy));
+		};
+	}
+}
+
+TEST_CASE("VM")
+{
+	SECTION("Mathmatical Expressions") {
+
+		SECTION("Testing return types of mathmatical expressions.")
+		{
+			REQUIRE(eval_simple("3").type() == BeanObjectType::INT);
+			REQUIRE(eval_simple("3.0").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.5").type() == BeanObjectType::DOUBLE);
+
+			REQUIRE(eval_simple("3 + 10").type() == BeanObjectType::INT);
+			REQUIRE(eval_simple("3.0 + 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3 + 10.0").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 + 10.0").type() == BeanObjectType::DOUBLE);
+
+
+			REQUIRE(eval_simple("3 - 10").type() == BeanObjectType::INT);
+			REQUIRE(eval_simple("3.0 - 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3 - 10.0").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 - 10.0").type() == BeanObjectType::DOUBLE);
+
+			REQUIRE(eval_simple("3 * 10").type() == BeanObjectType::INT);
+			REQUIRE(eval_simple("3.0 * 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3 * 10.0").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 * 10.0").type() == BeanObjectType::DOUBLE);
+
+			REQUIRE(eval_simple("3 / 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 / 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3 / 10.0").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 / 10.0").type() == BeanObjectType::DOUBLE);
+
+			REQUIRE(eval_simple("3 ^ 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 ^ 10").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3 ^ 10.0").type() == BeanObjectType::DOUBLE);
+			REQUIRE(eval_simple("3.0 ^ 10.0").type() == BeanObjectType::DOUBLE);
+		}
+
+		SECTION("Testing correctness of mathmatical operators.")
+		{
+			REQUIRE(eval_simple("3").as_int() == 3);
+			REQUIRE(are_same(eval_simple("3.0").as_double(), 3.0));
+			REQUIRE(are_same(eval_simple("3.5").as_double(), 3.5));
+			REQUIRE(are_same(eval_simple("0x10").as_double(), 16.0));
+
+			// The words strtod reads as numbers are numbers where a value is expected, and names elsewhere.
+			REQUIRE(std::isnan(eval_simple("nan").as_double()));
+			REQUIRE(eval_simple("Infinity").as_double() == std::numeric_limits<double>::infinity());
+			REQUIRE(eval_simple("var inf = 3; inf").as_double() == std::numeric_limits<double>::infinity());
+			REQUIRE(eval_simple("var inf = 3; inf = 4; 2").as_int() == 2);
+			REQUIRE(eval_simple("fun nan { return 5 } nan()").as_int() == 5);
+
+			REQUIRE(eval_simple("3 + 10").as_int() == 13);
+			REQUIRE(are_same(eval_simple("3.0 + 10").as_double(), 13.0));
+			REQUIRE(are_same(eval_simple("3 + 10.0").as_double(), 13.0));
+			REQUIRE(are_same(eval_simple("3.0 + 10.0").as_double(), 13.0));
+
+
+			REQUIRE(eval_simple("3 - 10").as_int() == -7);
+			REQUIRE(are_same(eval_simple("3.0 - 10").as_double(), -7.0));
+			REQUIRE(are_same(eval_simple("3 - 10.0").as_double(), -7.0));
+			REQUIRE(are_same(eval_simple("3.0 - 10.0").as_double(), -7.0));
+
+			REQUIRE(eval_simple("3 * 10").as_int() == 30);
+			REQUIRE(are_same(eval_simple("3.0 * 10").as_double(), 30.0));
+			REQUIRE(are_same(eval_simple("3 * 10.0").as_double(), 30.0));
+			REQUIRE(are_same(eval_simple("3.0 * 10.0").as_double(), 30.0));
+
+			// all division results in a floating point value.
+			REQUIRE(are_same(eval_simple("10 / 2").as_double(), 5.0));
+			REQUIRE(are_same(eval_simple("3 / 10").as_double(), double(3) / double(10)));
+			REQUIRE(are_same(eval_simple("3.0 / 10").as_double(), double(3) / double(10)));
+			REQUIRE(are_same(eval_simple("3 / 10.0").as_double(), double(3) / double(10)));
+			REQUIRE(are_same(eval_simple("3.0 / 10.0").as_double(), double(3) / double(10)));
+
+			// all pow results in a floating point value.
+			REQUIRE(are_same(eval_simple("2 ^ 2").as_double(), 4.0));
+			REQUIRE(are_same(eval_simple("3 ^ 10").as_double(), 59049.0));
+			REQUIRE(are_same(eval_simple("3.0 ^ 10").as_double(), 59049.0));
+			REQUIRE(are_same(eval_simple("3 ^ 10.0").as_double(), 59049.0));
+			REQUIRE(are_same(eval_simple("3.0 ^ 10.0").as_double(), 59049.0));
+		}
+
+		SECTION("Ensuring any ammount of spaces seperating operators is allowed and does not affect the output.") {
+			REQUIRE(eval_simple("   3").as_int() == 3);
+			REQUIRE(eval_simple("3    ").as_int() == 3);
+			REQUIRE(eval_simple("   3   ").as_int() == 3);
+			REQUIRE(eval_simple(" 3  ").as_int() == 3);
+			REQUIRE(eval_simple("  3    ").as_int() == 3);
+
+			REQUIRE(eval_simple(" 1  +3").as_int() == 4);
+			REQUIRE(eval_simple("3  +1  ").as_int() == 4);
+		}
+
+		SECTION("Order of ops sans parentheses") {
+			REQUIRE(are_same(eval_simple("3 + 3 * 6").as_int(), 21));
+			REQUIRE(are_same(eval_simple("3 + 2 * 4").as_int(), 11));
+			REQUIRE(are_same(eval_simple("3+2-1").as_int(), 4));
+			REQUIRE(are_same(eval_simple("7+4*9-1").as_int(), 42));
+			REQUIRE(are_same(eval_simple("9 * 7 / 4").as_double(), 15.75));
+		}
+
+		SECTION("Parentheses", "[parentheses]") {
+			REQUIRE(are_same(eval_simple("(3)").as_int(), 3));
+			REQUIRE(are_same(eval_simple("((3))").as_int(), 3));
+			REQUIRE(are_same(eval_simple("(((3)))").as_int(), 3));
+			REQUIRE(are_same(eval_simple("(3 + 2) * 4").as_int(), 20));
+			REQUIRE(are_same(eval_simple("((3 + 2) * 4)").as_int(), 20));
+			REQUIRE(are_same(eval_simple("(4 + 5 * (2 + 3) * 5) * 5 * (4/3)").as_double(), 860));
+		}
+
+	}
+
+	SECTION("Literals are constants of the compiled script")
+	{
+		bean_state state;
+
+		const auto script = ast_builder::compile(tokenizer::tokenize_stream("3 + 3 * 2.5 - 2.5"), state);
+		REQUIRE(script->get_constants().size() == 2);
+		REQUIRE(are_same(script->eval(state).as_double(), 8.0));
+
+		const auto literal = ast_builder::compile(tokenizer::tokenize_stream("7"), state);
+		REQUIRE(literal->eval(state) == literal->eval(state));
+		REQUIRE(literal->eval(state) == literal->get_constants().get_constants()[0]);
+	}
+
+	SECTION("Variables")
+	{
+		{
+			auto [state, result] = eval_simple_all("var x = (1 + 2);");
+			REQUIRE(state.variables.size() == 1);
+			REQUIRE(state.variables.count("x") == 1);
+			REQUIRE(state.variables["x"].as_int() == 3);
+		}
+
+		{
+			auto [state, result] = eval_simple_all("var x = (1 + 2); var y = x + 1;");
+			
+			REQUIRE(state.variables.size() == 2);
+			
+			REQUIRE(state.variables.count("x") == 1);
+			REQUIRE(state.variables["x"].as_int() == 3);
+
+			REQUIRE(state.variables.count("y") == 1);
+			REQUIRE(state.variables["y"].as_int() == 4);
+		}
+	}
+
+	SECTION("Variables are resolved to slots")
+	{
+		auto vm = bean_vm();
+
+		const auto script = vm.compile("var slot_a = 1; var slot_b = slot_a + 1; slot_a = slot_b * 10;");
+		const auto& code = *script->get_code();
+
+		std::set<std::uint32_t> slots;
+
+		for (std::uint32_t i = 0; i < code.get_names().size(); i++)
+		{
+			if (code.get_names()[i] == "slot_a" || code.get_names()[i] == "slot_b")
+				slots.insert(code.get_slots()[i]);
+		}
+
+		// Every program numbers a name the same way, states share the numbering.
+		REQUIRE(slots.size() == 2);
+		REQUIRE(slots.count(variable_slots::find("slot_a")) == 1);
+		REQUIRE(slots.count(variable_slots::find("slot_b")) == 1);
+
+		vm.run(script);
+		REQUIRE(vm.get_state().variables["slot_a"].as_int() == 20);
+		REQUIRE(*vm.get_state().variables.find(variable_slots::find("slot_b")) == vm.get_state().variables["slot_b"]);
+
+		// Assigning a value that defines variables while it is evaluated.
+		vm.eval("fun grow { var slot_grown_1 = 1; var slot_grown_2 = 2; return slot_grown_2 } slot_a = grow();");
+		REQUIRE(vm.get_state().variables["slot_a"].as_int() == 2);
+		REQUIRE(vm.get_state().variables.count("slot_grown_1") == 1);
+
+		REQUIRE(vm.get_state().variables.count("slot_never_defined") == 0);
+		REQUIRE_THROWS(vm.eval("slot_never_defined = 1;"));
+	}
+
+	SECTION("Parser")
+	{
+		{
+			auto [state, result] = eval_simple_all("var x = 1; x = x + 41; x");
+			REQUIRE(state.variables["x"].as_int() == 42);
+			REQUIRE(result.as_int() == 42);
+		}
+
+		REQUIRE(are_same(eval_simple("2 ^ 3 ^ 2").as_double(), 64.0));
+		REQUIRE(are_same(eval_simple("10 - 4 - 3").as_int(), 3));
+		REQUIRE(are_same(eval_simple("2 * (3 + (4 - 1) * 2) ^ 2").as_double(), 162.0));
+
+		{
+			std::function<std::int32_t(std::int32_t, std::int32_t)> add_two_ints = [&](std::int32_t a, std::int32_t b) {
+				return a + b;
+			};
+
+			auto vm = bean_vm();
+			vm.bind_function("add_two_ints", add_two_ints);
+			REQUIRE(vm.eval_result("add_two_ints(add_two_ints(1, 2), (3 + 4) * 2)").as_int() == 17);
+		}
+
+		{
+			std::string nested;
+			for (auto i = 0; i < 1000; i++)
+				nested += "(1 + ";
+			nested += "0" + std::string(1000, ')');
+
+			REQUIRE(eval_simple(nested).as_int() == 1000);
+		}
+
+		REQUIRE_THROWS(eval_simple("(1 + 2"));
+		REQUIRE_THROWS(eval_simple("1 + 2 3"));
+		REQUIRE_THROWS(eval_simple("3 = 4"));
+		REQUIRE_THROWS(eval_simple("undefined_variable + 1"));
+	}
+
+	SECTION("Nodes live in the arena of their script")
+	{
+		bean_state state;
+
+		auto script = ast_builder::compile(tokenizer::tokenize_stream("var x = 21; fun twice { return x + x } x = twice();"), state);
+		REQUIRE(script->get_arena().bytes_used() > 0);
+		REQUIRE(script->get_arena().block_count() == 1);
+
+		const auto statements = script->get_root()->get_children();
+		REQUIRE(statements.size() == 3);
+
+		// Identifiers are interned, every mention of x shares one string.
+		const auto sum = statements[1]->get_left()->get_left();
+		REQUIRE(sum->get_left()->get_identifier().data() == sum->get_right()->get_identifier().data());
+		REQUIRE(statements[0]->get_identifier().data() == sum->get_left()->get_identifier().data());
+
+		script->eval(state);
+		script.reset();
+
+		// The function body keeps the arena alive after the script is dropped.
+		REQUIRE(state.variables["x"].as_int() == 42);
+		REQUIRE(ast_builder::compile(tokenizer::tokenize_stream("twice()"), state)->eval(state).as_int() == 84);
+	}
+
+	SECTION("Flat ast")
+	{
+		bean_state state;
+
+		const auto script = ast_builder::compile(tokenizer::tokenize_stream("var x = 2; fun f { return x * 3 } var y = (x + 1.5) ^ f();"), state);
+		const auto& code = *script->get_code();
+		const auto& nodes = code.get_nodes();
+
+		REQUIRE(nodes.size() == 14);
+		REQUIRE(code.get_root() == nodes.size() - 1);
+		REQUIRE(code.get_names().size() == 6);
+		REQUIRE(code.get_constants().size() == 3);
+
+		// Children are laid out before their parents.
+		for (std::uint32_t i = 0; i < nodes.size(); i++)
+		{
+			for (const auto child : code.get_children(i))
+				REQUIRE(child < i);
+		}
+
+		REQUIRE(code.to_string(code.get_root()) == "statement list");
+		REQUIRE(code.to_string(code.get_children(code.get_root())[2]) == "create and set y");
+
+		REQUIRE(script->eval(state).type() == BeanObjectType::None);
+		REQUIRE(are_same(state.variables["y"].as_double(), std::pow(3.5, 6)));
+	}
+
+	SECTION("Parsing is independent of any state")
+	{
+		const auto script = ast_builder::compile(tokenizer::tokenize_stream("var y = x * 2; fun f { return y + g() } y = f();"));
+
+		const auto& symbols = script->get_symbols();
+		REQUIRE(symbols.get_defined(symbol_kind::variable) == std::set<std::string, std::less<>>{ "y" });
+		REQUIRE(symbols.get_defined(symbol_kind::function) == std::set<std::string, std::less<>>{ "f" });
+		REQUIRE(symbols.get_external(symbol_kind::variable) == std::set<std::string, std::less<>>{ "x" });
+		REQUIRE(symbols.get_external(symbol_kind::function) == std::set<std::string, std::less<>>{ "g" });
+
+		std::function<std::int32_t()> one = [] { return 1; };
+		std::function<std::int32_t()> ten = [] { return 10; };
+
+		auto first = bean_vm();
+		auto second = bean_vm();
+
+		REQUIRE_THROWS(script->link(first.get_state()));
+
+		first.eval("var x = 1;");
+		first.bind_function("g", one);
+		second.eval("var x = 5;");
+		second.bind_function("g", ten);
+
+		for (auto* vm : { &first, &second })
+		{
+			script->link(vm->get_state());
+			script->eval(vm->get_state());
+		}
+
+		REQUIRE(first.get_state().variables["y"].as_int() == 3);
+		REQUIRE(second.get_state().variables["y"].as_int() == 20);
+		REQUIRE(first.get_state().get_functions().count("f") == 1);
+
+		// Parses share nothing, so they can run concurrently.
+		const auto expected = ast_builder::compile(tokenizer::tokenize_stream(generate_script(500, false)))->get_code()->get_nodes().size();
+
+		std::vector<std::future<std::shared_ptr<compiled_script>>> parses;
+
+		for (auto i = 0; i < 4; i++)
+			parses.push_back(std::async(std::launch::async, [] { return ast_builder::compile(tokenizer::tokenize_stream(generate_script(500, false))); }));
+
+		for (auto& parse : parses)
+			REQUIRE(parse.get()->get_code()->get_nodes().size() == expected);
+	}
+
+	SECTION("Compiled script cache")
+	{
+		auto vm = bean_vm();
+		auto& cache = vm.get_cache();
+
+		vm.eval("var x = 1;");
+		REQUIRE(vm.eval_result("x + 1").as_int() == 2);
+		vm.eval("x = 5;");
+		REQUIRE(vm.eval_result("x + 1").as_int() == 6);
+
+		REQUIRE(cache.hits() == 1);
+		REQUIRE(cache.misses() == 3);
+		REQUIRE(cache.size() == 3);
+
+		// A hit is still linked against the current state.
+		REQUIRE_THROWS(vm.eval_result("y + 1"));
+		REQUIRE(cache.size() == 4);
+		vm.eval("var y = 2;");
+		REQUIRE(vm.eval_result("y + 1").as_int() == 3);
+		REQUIRE(cache.hits() == 2);
+
+		vm.set_cache_capacity(2);
+		REQUIRE(cache.size() == 2);
+
+		// "y + 1" and "var y = 2;" were used last, "x + 1" has been evicted.
+		vm.eval_result("x + 1");
+		REQUIRE(cache.hits() == 2);
+		vm.eval_result("y + 1");
+		REQUIRE(cache.hits() == 3);
+		vm.eval("var y = 2;");
+		REQUIRE(cache.hits() == 3);
+
+		vm.set_cache_capacity(0);
+		REQUIRE(cache.size() == 0);
+		REQUIRE(vm.eval_result("x + 1").as_int() == 6);
+		REQUIRE(cache.size() == 0);
+
+		// A copy indexes its own entries, so it outlives the original.
+		auto original = script_cache(4);
+		original.insert("1", vm.compile("1"));
+		original.insert("2", vm.compile("2"));
+
+		auto copy = original;
+		original.clear();
+
+		REQUIRE(copy.find("1") != nullptr);
+		copy.set_capacity(1);
+		REQUIRE(copy.size() == 1);
+		REQUIRE(copy.find("1") != nullptr);
+		REQUIRE(copy.find("2") == nullptr);
+	}
+
+	SECTION("Programs")
+	{
+		program shared;
+
+		{
+			auto vm = bean_vm();
+			shared = vm.compile("fun next { return counter + step } counter = next();");
+
+			REQUIRE_THROWS(vm.run(shared));
+			vm.eval("var counter = 0; var step = 1;");
+
+			for (auto i = 0; i < 3; i++)
+				vm.run(shared);
+
+			REQUIRE(vm.get_state().variables["counter"].as_int() == 3);
+			REQUIRE(vm.compile("fun next { return counter + step } counter = next();") == shared);
+		}
+
+		// The program outlives the VM that compiled it and runs on other VMs and threads.
+		std::vector<std::future<std::int32_t>> runs;
+
+		for (auto step = 1; step <= 4; step++)
+		{
+			runs.push_back(std::async(std::launch::async, [shared, step]
+			{
+				auto vm = bean_vm();
+				vm.eval("var counter = 0; var step = " + std::to_string(step) + ";");
+
+				for (auto i = 0; i < 1000; i++)
+					vm.run(shared);
+
+				return vm.get_state().variables["counter"].as_int();
+			}));
+		}
+
+		for (auto step = 1; step <= 4; step++)
+			REQUIRE(runs[step - 1].get() == 1000 * step);
+	}
+
+	SECTION("Function bodies are parsed on first call")
+	{
+		auto vm = bean_vm();
+
+		// The body of broken is not valid, it only fails once called.
+		const auto script = vm.compile("fun broken { return 1 + } fun twice { fun inner { return 21 } return inner() * 2 } var x = twice();");
+		REQUIRE(script->get_code()->lazy_count() == 2);
+
+		vm.run(script);
+		REQUIRE(vm.get_state().variables["x"].as_int() == 42);
+		REQUIRE_THROWS(vm.eval("broken();"));
+
+		// Unknown names in a lazy body are reported when it runs.
+		vm.eval("fun missing { return not_defined }");
+		REQUIRE_THROWS(vm.eval("missing();"));
+
+		vm.eval("var n = 10; var total = 0; fun count_down { total = total + n; n = n - 1; return n }");
+		while (vm.eval_result("count_down();").as_int() > 0) {}
+		REQUIRE(vm.get_state().variables["total"].as_int() == 55);
+
+		// Eager compilation parses everything up front.
+		REQUIRE_THROWS(ast_builder::compile(tokenizer::tokenize_stream(std::string("fun broken { return 1 + }"))));
+
+		// Threads calling the same function for the first time share one parse.
+		const auto shared = vm.compile("fun slow { return value * 3 } value = slow();");
+		std::vector<std::future<std::int32_t>> runs;
+
+		for (auto i = 1; i <= 4; i++)
+		{
+			runs.push_back(std::async(std::launch::async, [shared, i]
+			{
+				auto thread_vm = bean_vm();
+				thread_vm.eval("var value = " + std::to_string(i) + ";");
+				thread_vm.run(shared);
+				return thread_vm.get_state().variables["value"].as_int();
+			}));
+		}
+
+		for (auto i = 1; i <= 4; i++)
+			REQUIRE(runs[i - 1].get() == i * 3);
+	}
+
+	SECTION("Top-level function bodies are parsed in parallel")
+	{
+		const auto library = generate_library(200) + "fun total { return f3() + f199() + scale } return total();";
+		const auto tokens = tokenizer::tokenize_stream(library);
+
+		thread_pool serial(1);
+		thread_pool parallel(4);
+
+		const auto expected = ast_builder::compile(tokens, serial);
+		const auto merged = ast_builder::compile(tokens, parallel);
+
+		REQUIRE(merged->get_code()->get_nodes().size() == expected->get_code()->get_nodes().size());
+		REQUIRE(merged->get_constants().size() == expected->get_constants().size());
+		REQUIRE(merged->get_symbols().get_external(symbol_kind::variable) == expected->get_symbols().get_external(symbol_kind::variable));
+		REQUIRE(merged->get_symbols().get_defined(symbol_kind::function).size() == 201);
+
+		auto same_nodes = true;
+
+		for (std::uint32_t i = 0; i < merged->get_code()->get_nodes().size(); i++)
+			same_nodes = same_nodes && merged->get_code()->to_string(i) == expected->get_code()->to_string(i);
+
+		REQUIRE(same_nodes);
+
+		// Bodies parsed on the workers have their slots assigned when the script takes them.
+		REQUIRE(merged->get_code()->get_slots() == expected->get_code()->get_slots());
+		REQUIRE(merged->get_code()->get_call_slots() == expected->get_code()->get_call_slots());
+
+		auto vm = bean_vm();
+		vm.eval("var scale = 1;");
+		REQUIRE(vm.run(merged).as_double() == vm.run(expected).as_double());
+
+		// An error in any body is reported like a serial parse would.
+		REQUIRE_THROWS(ast_builder::compile(tokenizer::tokenize_stream(generate_library(10) + "fun broken { return * }" + generate_library(10)), parallel));
+
+		// A function defined by a body parsed on a worker keeps the whole script alive, whose arena holds the
+		// names in its body.
+		{
+			const auto nested = ast_builder::compile(tokenizer::tokenize_stream("fun outer { fun nested_function { return nested_helper() } return 1 } fun other { return 2 } outer();"), parallel);
+			nested->get_root()->eval(vm.get_state());
+		}
+
+		vm.eval("fun outer { return 0 } fun other { return 0 } fun nested_helper { return 42 }");
+		REQUIRE(vm.eval_result("nested_function();").as_int() == 42);
+	}
+
+	SECTION("Script files")
+	{
+		const std::string path = "bean_test_script.bean";
+
+		{
+			std::ofstream file(path, std::ios::binary);
+			file << "fun get_two { return 2 }\r\nvar x = get_two() * 21;\r\nreturn x;";
+		}
+
+		const auto source = source_buffer::map_file(path);
+		REQUIRE(source->is_mapped());
+		REQUIRE(same_tokens(tokenizer::tokenize(source), tokenizer::tokenize_file(path)));
+
+		{
+			std::ifstream file(path, std::ios::binary);
+			REQUIRE(same_tokens(tokenizer::tokenize(file), tokenizer::tokenize(source)));
+		}
+
+		auto vm = bean_vm();
+		REQUIRE(vm.eval_file_result(path).as_int() == 42);
+
+		std::remove(path.c_str());
+	}
+
+	SECTION("Precompiled scripts")
+	{
+		const std::string path = "bean_test_precompiled.bean";
+
+		{
+			std::ofstream file(path, std::ios::binary);
+			file << "fun scale { return base * 2.5 ^ 2 } var result = scale() + add_two_ints(1, 2); base = result;";
+		}
+
+		std::function<std::int32_t(std::int32_t, std::int32_t)> add_two_ints = [&](std::int32_t a, std::int32_t b) {
+			return a + b;
+		};
+
+		const auto output = precompile_file(path);
+		REQUIRE(output == "bean_test_precompiled.beanc");
+
+		auto vm = bean_vm();
+		vm.bind_function("add_two_ints", add_two_ints);
+
+		const auto loaded = vm.load_compiled(output);
+		REQUIRE(loaded->get_code()->get_nodes().size() == ast_builder::compile(tokenizer::tokenize_stream(std::string("fun scale { return base * 2.5 ^ 2 } var result = scale() + add_two_ints(1, 2); base = result;")))->get_code()->get_nodes().size());
+		REQUIRE(loaded->get_symbols().get_external(symbol_kind::variable).count("base") == 1);
+		REQUIRE(loaded->get_symbols().get_defined(symbol_kind::function).count("scale") == 1);
+
+		REQUIRE_THROWS(vm.run(loaded));
+		vm.eval("var base = 4;");
+		vm.run(loaded);
+		REQUIRE(are_same(vm.get_state().variables["base"].as_double(), 28.0));
+
+		// Damaged files are rejected.
+		{
+			std::string bytes(source_buffer::map_file(output)->view());
+
+			std::ofstream(output, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() / 2);
+			REQUIRE_THROWS(vm.load_compiled(output));
+
+			bytes[4] = 99;
+			std::ofstream(output, std::ios::binary | std::ios::trunc) << bytes;
+			REQUIRE_THROWS(vm.load_compiled(output));
+		}
+
+		// No byte of a file is left unset, compiling and saving a script again gives the same file.
+		{
+			const std::string source = "fun scale { return base * 2.5 ^ 2 } var result = scale() + add_two_ints(1, 2); base = result;";
+
+			const auto compiled = ast_builder::compile(tokenizer::tokenize_stream(source));
+
+			std::stringstream first;
+			std::stringstream second;
+			precompiled::save(*compiled, first);
+			precompiled::save(*ast_builder::compile(tokenizer::tokenize_stream(source)), second);
+
+			REQUIRE(first.str() == second.str());
+
+			// The bytes between a node's kind and its name.
+			const auto bytes = first.str();
+			auto zeroed = true;
+
+			for (std::size_t node = 0; node < compiled->get_code()->get_nodes().size(); node++)
+			{
+				for (std::size_t byte = 1; byte < 4; byte++)
+					zeroed = zeroed && bytes[sizeof(precompiled::precompiled_header) + node * sizeof(flat_node) + byte] == 0;
+			}
+
+			REQUIRE(zeroed);
+		}
+
+		// A name table cut short, every node still names entry 0.
+		{
+			std::stringstream stream;
+			precompiled::save(*ast_builder::compile(tokenizer::tokenize_stream(std::string("lonely_variable"))), stream);
+
+			auto bytes = stream.str();
+			precompiled::precompiled_header header;
+			std::memcpy(&header, bytes.data(), sizeof(header));
+
+			header.name_count = 0;
+			std::fill(std::begin(header.symbol_counts), std::end(header.symbol_counts), 0u);
+			std::memcpy(&bytes[0], &header, sizeof(header));
+
+			REQUIRE_THROWS(precompiled::load(source_buffer::create(bytes)));
+		}
+
+		std::remove(path.c_str());
+		std::remove(output.c_str());
+	}
+
+	SECTION("Call sites cache their target until a binding changes")
+	{
+		std::function<std::int32_t()> source = [] { return 1; };
+		std::function<std::int32_t()> rebound = [] { return 2; };
+
+		auto vm = bean_vm();
+		vm.bind_function("source", source);
+
+		const auto script = vm.compile("fun twice { return source() + source() } var result = twice();");
+		vm.run(script);
+		REQUIRE(vm.get_state().variables["result"].as_int() == 2);
+
+		// Running the script again keeps its function, nothing is invalidated.
+		const auto version = vm.get_state().get_functions_version();
+		vm.run(script);
+		REQUIRE(vm.get_state().get_functions_version() == version);
+
+		vm.bind_function("source", rebound);
+		REQUIRE(vm.get_state().get_functions_version() != version);
+
+		vm.run(script);
+		REQUIRE(vm.get_state().variables["result"].as_int() == 4);
+
+		// A function replacing itself while it runs keeps running. Without the cache nothing else owns its code.
+		vm.set_cache_capacity(0);
+
+		std::function<std::int32_t()> rebind = [&vm] {
+			vm.eval("fun replaced { return 7 }");
+			return 3;
+		};
+
+		vm.bind_function("rebind", rebind);
+		vm.eval("fun replaced { return rebind() + rebind() }");
+		REQUIRE(vm.eval_result("replaced();").as_int() == 6);
+		REQUIRE(vm.eval_result("replaced();").as_int() == 7);
+	}
+
+	SECTION("Bytecode")
+	{
+		auto vm = bean_vm();
+
+		const auto script = vm.compile("var x = 2; fun twice { return x * 2 } x = twice() + 1.5; x");
+		const auto& bytecode = *script->get_bytecode();
+
+		REQUIRE(bytecode.disassemble() ==
+			"0 push_constant 2\n"
+			"1 define_variable slot " + std::to_string(variable_slots::find("x")) + "\n"
+			"2 define_function twice\n"
+			"3 require_variable slot " + std::to_string(variable_slots::find("x")) + "\n"
+			"4 call twice 0\n"
+			"5 call_native twice 0\n"
+			"6 push_constant 1.500000\n"
+			"7 add\n"
+			"8 store_variable slot " + std::to_string(variable_slots::find("x")) + "\n"
+			"9 load_variable slot " + std::to_string(variable_slots::find("x")) + "\n"
+			"10 ret\n");
+
+		REQUIRE(bytecode.get_functions().size() == 1);
+		REQUIRE(bytecode.get_functions()[0].lazy);
+
+		// Same results as the flat code, which runs the script on its own state.
+		bean_state flat_state;
+		REQUIRE(are_same(vm.run(script).as_double(), script->eval(flat_state).as_double()));
+		REQUIRE(vm.get_state().value_top == 0);
+		REQUIRE(vm.get_state().call_frames.empty());
+
+		// Errors leave the stacks empty, the next run starts clean.
+		REQUIRE_THROWS(vm.eval("fun fails { return 1 + missing_variable } var y = 3 * (2 + fails());"));
+		REQUIRE(vm.get_state().value_top == 0);
+		REQUIRE(vm.get_state().call_frames.empty());
+
+		// Native functions can run scripts of their own while a call is in progress.
+		std::function<std::int32_t(std::int32_t)> nested = [&vm](std::int32_t value) {
+			return vm.eval_result("fun inner { return " + std::to_string(value) + " * 2 } inner();").as_int() + 1;
+		};
+
+		vm.bind_function("nested", nested);
+		REQUIRE(vm.eval_result("fun outer { return 100 + nested(20) } outer() * 2").as_int() == 282);
+		REQUIRE(vm.get_state().value_top == 0);
+
+		// Both dispatch loops run the same code.
+		const auto calls = vm.compile("var n = 1; fun inc { n = n + 1; return n } fun twice { return inc() * inc() } twice() + nested(2)");
+		REQUIRE(bean_vm::execute<dispatch_mode::switch_table>(vm.get_state(), *calls->get_bytecode()).as_int() == 11);
+
+#if BEAN_THREADED_DISPATCH
+		REQUIRE(bean_vm::execute<dispatch_mode::threaded>(vm.get_state(), *calls->get_bytecode()).as_int() == 11);
+#endif
+	}
+
+	SECTION("Numbers are unboxed")
+	{
+		REQUIRE(sizeof(bean_value) == 16);
+
+		REQUIRE(bean_value(2).lh_plus(bean_value(3)).type() == BeanObjectType::INT);
+		REQUIRE(bean_value(7).lh_divide(bean_value(2)).as_double() == 3.5);
+		REQUIRE(bean_value(2).lh_multiply(bean_value(1.5)).as_double() == 3.0);
+		REQUIRE(!bean_value());
+		REQUIRE(bean_value::none());
+
+		// Other objects stay boxed and are shared by copies.
+		const bean_value reference(std::make_shared<bean_object_reference>(std::make_shared<bean_object_integer>(4)));
+		const auto copy = reference;
+		REQUIRE(copy.type() == BeanObjectType::REFERENCE);
+		REQUIRE(copy.to_object() == reference.to_object());
+		REQUIRE(reference.lh_plus(bean_value(1)).as_int() == 5);
+
+		auto vm = bean_vm();
+		const auto script = vm.compile("var x = 3; var y = 2.5; var z = (x + y) * (x - y) / 2 ^ 2 + x * 4 - y / 5; z = z * 2 + x - (y + 1) * (z - x); z");
+		const auto expected = vm.run(script).as_double();
+
+		// Once the stacks exist, arithmetic on numbers runs without touching the heap.
+		const auto before = allocation_count.load();
+		const auto result = vm.run(script);
+		REQUIRE(allocation_count.load() == before);
+		REQUIRE(are_same(result.as_double(), expected));
+	}
+
+	SECTION("Operators dispatch on both operand types")
+	{
+		auto& operators = operator_table::shared();
+
+		REQUIRE(bean_value(7).lh_minus(bean_value(2)).as_int() == 5);
+		REQUIRE(are_same(bean_value(2.5).lh_pow(bean_value(2)).as_double(), 6.25));
+		REQUIRE(bean_value(9).lh_divide(bean_value(3)).type() == BeanObjectType::DOUBLE);
+
+		// References forward every operator to the object they refer to.
+		const bean_value reference(std::make_shared<bean_object_reference>(std::make_shared<bean_object_double>(1.5)));
+		REQUIRE(are_same(reference.lh_minus(bean_value(1)).as_double(), 0.5));
+
+		REQUIRE_THROWS(operators.set(binary_operator::plus, BeanObjectType::INT, BeanObjectType::INT, operators.get(binary_operator::minus, BeanObjectType::INT, BeanObjectType::INT)));
+
+		// A custom object that counts how often it was added to.
+		class counter final : public bean_object
+		{
+		public:
+			counter() : bean_object(BeanObjectType::CUSTOM)
+			{
+				object_ = &count_;
+			}
+
+		private:
+			std::int32_t count_ = 0;
+		};
+
+		operators.set(binary_operator::plus, BeanObjectType::CUSTOM, BeanObjectType::INT, [](const bean_value& lh, const bean_value& rh)
+		{
+			lh.to_object()->as_int() += rh.as_int();
+			return lh;
+		});
+
+		auto vm = bean_vm();
+		vm.get_state().variables["custom_counter"] = bean_value(std::make_shared<counter>());
+
+		const auto result = vm.eval_result("custom_counter + 2 + 3");
+		REQUIRE(result.type() == BeanObjectType::CUSTOM);
+		REQUIRE(result.as_int() == 5);
+		REQUIRE(vm.get_state().variables["custom_counter"].as_int() == 5);
+	}
+
+	SECTION("Arithmetic is quickened")
+	{
+		auto vm = bean_vm();
+		auto& variables = vm.get_state().variables;
+
+		variables["quick_a"] = bean_value(1);
+		variables["quick_b"] = bean_value(2);
+
+		const auto script = vm.compile("quick_a * quick_b + 2.5");
+		const auto& bytecode = *script->get_bytecode();
+
+		for (auto i = 0; i < bytecode_program::quickening_threshold - 1; i++)
+			REQUIRE(vm.run(script).as_double() == 4.5);
+
+		REQUIRE(bytecode.get_quickening().sites == 2);
+		REQUIRE(bytecode.get_quickening().specialized == 0);
+
+		// Only the site that saw two integers is specialized, the other one mixes types.
+		REQUIRE(vm.run(script).as_double() == 4.5);
+		REQUIRE(bytecode.get_quickening().specialized == 1);
+		REQUIRE(bytecode.disassemble().find("multiply_int_int") != std::string::npos);
+
+		const auto sum = vm.compile("quick_a + quick_b");
+
+		for (auto i = 0; i < bytecode_program::quickening_threshold; i++)
+			REQUIRE(vm.run(sum).as_int() == 3);
+
+		REQUIRE(sum->get_bytecode()->get_quickening().specialized == 1);
+
+		// The guard catches operands of another type, the site goes back to the generic instruction for good.
+		variables["quick_a"] = bean_value(1.5);
+		REQUIRE(vm.run(sum).as_double() == 3.5);
+		REQUIRE(sum->get_bytecode()->get_quickening().despecialized == 1);
+
+		variables["quick_a"] = bean_value(1);
+
+		for (auto i = 0; i < bytecode_program::quickening_threshold * 2; i++)
+			REQUIRE(vm.run(sum).as_int() == 3);
+
+		REQUIRE(sum->get_bytecode()->get_quickening().specialized == 1);
+		REQUIRE(sum->get_bytecode()->disassemble().find("add_int_int") == std::string::npos);
+
+		// Threads share one program while their operands differ, so sites are quickened and sent back
+		// concurrently. Every site must keep computing its own operator.
+		const auto shared = vm.compile("quick_c * quick_c + quick_c - quick_c / 2 + quick_c ^ 2");
+		std::vector<std::future<std::int32_t>> runs;
+
+		for (auto i = 0; i < 8; i++)
+		{
+			runs.push_back(std::async(std::launch::async, [shared, i]
+			{
+				auto thread_vm = bean_vm();
+				const auto value = i % 2 == 0 ? bean_value(i + 1) : bean_value(i + 0.5);
+				const auto number = value.type() == BeanObjectType::INT ? double(value.as_int()) : value.as_double();
+				const auto expected = number * number + number - number / 2 + std::pow(number, 2);
+
+				thread_vm.get_state().variables["quick_c"] = value;
+
+				std::int32_t wrong = 0;
+
+				for (auto run = 0; run < 200; run++)
+				{
+					if (!are_same(thread_vm.run(shared).as_double(), expected))
+						wrong++;
+				}
+
+				return wrong;
+			}));
+		}
+
+		for (auto& run : runs)
+			REQUIRE(run.get() == 0);
+
+		const auto& quickened = shared->get_bytecode()->get_instructions();
+		const auto fresh = bytecode_program::compile(shared->get_code());
+
+		for (std::size_t i = 0; i < quickened.size(); i++)
+		{
+			const auto original = fresh->get_instructions()[i].get_op();
+			const auto current = quickened[i].get_op();
+
+			if (original < opcode::add || original > opcode::power)
+			{
+				REQUIRE(current == original);
+				continue;
+			}
+
+			const auto offset = std::size_t(original) - std::size_t(opcode::add);
+			REQUIRE((current == original || current == opcode(std::size_t(opcode::add_int_int) + offset) || current == opcode(std::size_t(opcode::add_double_double) + offset)));
 		}
 	}
 
@@ -157,17 +1528,17 @@ TEST_CASE("VM")
 		
 		SECTION("Short Hand") {
 			vm.eval("fun get_pi { return 3.14159265 }");
-			REQUIRE(are_same(vm.eval_result("get_pi()")->as_double(), 3.14159265));
+			REQUIRE(are_same(vm.eval_result("get_pi()").as_double(), 3.14159265));
 
 			vm.eval("fun get_one { return 1 }");
-			REQUIRE(vm.eval_result("get_one()")->as_int() == 1);
+			REQUIRE(vm.eval_result("get_one()").as_int() == 1);
 
 			vm.eval("var x = get_one();");
-			REQUIRE(state.variables["x"]->as_int() == 1);
+			REQUIRE(state.variables["x"].as_int() == 1);
 
 			vm.eval("fun get_pi_approx { var pi = 22 / 7; return pi; }");
 			vm.eval("var pi_result = get_pi_approx();");
-			REQUIRE(are_same(vm.eval_result("get_pi_approx()")->as_double(), double(22.0) / double(7.0)));
+			REQUIRE(are_same(vm.eval_result("get_pi_approx()").as_double(), double(22.0) / double(7.0)));
 			
 		}
 	}
@@ -205,7 +1576,7 @@ TEST_CASE("VM")
 
 			auto res = vm.eval_result("get_double_five()");
 
-			REQUIRE(are_same(res->as_double(), double(5.0)));
+			REQUIRE(are_same(res.as_double(), double(5.0)));
 
 		}
 
@@ -221,7 +1592,7 @@ TEST_CASE("VM")
 
 			auto res = vm.eval_result("add_two_ints(1, 2)");
 
-			REQUIRE(res->as_int() == 3);
+			REQUIRE(res.as_int() == 3);
 
 		}
 
@@ -238,7 +1609,7 @@ TEST_CASE("VM")
 
 			auto res = vm.eval_result("add_int_double_return_double(1, 2.1)");
 
-			REQUIRE(are_same(res->as_double(), double(3.1)));
+			REQUIRE(are_same(res.as_double(), double(3.1)));
 
 		}
 	}
@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bean {
+
+	// Fixed set of worker threads fed from one queue.
+	class thread_pool
+	{
+	public:
+		explicit thread_pool(const std::size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+		{
+			// The thread calling parallel_for does its share of the work, so one thread needs no workers.
+			for (std::size_t i = 1; i < threads; i++)
+				workers_.emplace_back([this] { work(); });
+		}
+
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stopping_ = true;
+			}
+
+			wake_.notify_all();
+
+			for (auto& worker : workers_)
+				worker.join();
+		}
+
+		// Pool sized to the hardware, created on first use.
+		static thread_pool& shared()
+		{
+			static thread_pool pool;
+			return pool;
+		}
+
+		// Threads that run work, counting the caller of parallel_for.
+		[[nodiscard]] std::size_t size() const
+		{
+			return workers_.size() + 1;
+		}
+
+		// Calls body(i) for every i in [0, count) and returns once all calls finished. body must not throw.
+		template<typename Body>
+		void parallel_for(const std::size_t count, const Body& body)
+		{
+			std::atomic<std::size_t> next{ 0 };
+
+			const auto run = [&]
+			{
+				for (auto i = next++; i < count; i = next++)
+					body(i);
+			};
+
+			const auto helpers = std::min(workers_.size(), count > 0 ? count - 1 : 0);
+
+			std::mutex done_mutex;
+			std::condition_variable done;
+			std::size_t finished = 0;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+
+				for (std::size_t i = 0; i < helpers; i++)
+				{
+					tasks_.emplace_back([&]
+					{
+						run();
+
+						std::lock_guard<std::mutex> done_lock(done_mutex);
+
+						if (++finished == helpers)
+							done.notify_one();
+					});
+				}
+			}
+
+			wake_.notify_all();
+
+			run();
+
+			std::unique_lock<std::mutex> lock(done_mutex);
+			done.wait(lock, [&] { return finished == helpers; });
+		}
+
+	private:
+		void work()
+		{
+			for (;;)
+			{
+				std::function<void()> task;
+
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					wake_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+
+					if (tasks_.empty())
+						return;
+
+					task = std::move(tasks_.front());
+					tasks_.pop_front();
+				}
+
+				task();
+			}
+		}
+
+		std::vector<std::thread> workers_;
+		std::deque<std::function<void()>> tasks_;
+		std::mutex mutex_;
+		std::condition_variable wake_;
+		bool stopping_ = false;
+	};
+
+}
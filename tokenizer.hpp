@@ -1,13 +1,32 @@
 #pragma once
 #include <iostream>
+#include <cstdint>
+#include <cstring>
 #include <utility>
 #include <vector>
 #include <array>
 #include <sstream>
 #include <algorithm>
 #include <string>
+#include <string_view>
+#include <memory>
 #include <fstream>
 #include <streambuf>
+#include <charconv>
+#include <limits>
+#include "source_buffer.hpp"
+#include "fnv1a.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BEAN_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BEAN_TARGET_AVX2
+#else
+#define BEAN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 constexpr std::uint32_t invalid_token_index = -1;
 
@@ -30,7 +49,7 @@ inline std::vector<std::string> split_string(const std::string& str,
 	return strings;
 }
 
-enum class token_type
+enum class token_type : std::uint8_t
 {
 	invalid,
 	space,
@@ -53,7 +72,12 @@ enum class token_type
 	forward_slash,
 	tokentype_end,
 	carrot,
-	pow
+	pow,
+	kw_fun,
+	kw_var,
+	kw_return,
+	integer_literal,
+	double_literal
 };
 
 inline const char* to_string(token_type e)
@@ -82,54 +106,45 @@ inline const char* to_string(token_type e)
 	case token_type::forward_slash: return "forward slash";
 	case token_type::carrot: return "carrot";
 	case token_type::pow: return "pow";
+	case token_type::kw_fun: return "fun";
+	case token_type::kw_var: return "var";
+	case token_type::kw_return: return "return";
+	case token_type::integer_literal: return "integer literal";
+	case token_type::double_literal: return "double literal";
 	default: return "unknown";
 	}
 }
 
 
 
-class token_delim
+// Value of an integer_literal or double_literal token, parsed once by the lexer.
+union token_value
 {
-public:
-	token_delim(std::string delim, const token_type type): delim_(std::move(delim)), type_(type)
-	{
-		
-	}
-
-	[[nodiscard]] token_type get_type() const { return type_;  }
-
-	[[nodiscard]] const std::string& get_delim() const { return delim_; }
-
-	std::size_t match(const std::string_view& view) const
-	{
-		if (view.length() < delim_.length())
-			return 0;
-
-		return (std::memcmp(view.data(), delim_.data(), delim_.length())) == 0 ? delim_.length() : 0;
- 	}
-	
-private:
-	std::string delim_;
-	token_type type_;
+	std::int32_t integer;
+	double floating;
 };
 
-class token : public std::enable_shared_from_this<token>
+inline bool has_text(const token_type type)
+{
+	return type == token_type::symbol || type == token_type::integer_literal || type == token_type::double_literal;
+}
+
+class token
 {
 public:
-	token(const std::uint32_t pos, const std::uint32_t line, const token_type type, std::string text): pos_(pos), line_(line), type_(type), text_(
-		                                                                              std::move(text)), valid_(true)
+	token(const std::uint32_t pos, const std::uint32_t line, const token_type type, const std::string_view text, const token_value value = {}): pos_(pos), line_(line), type_(type), text_(text), value_(value)
 	{
 
 	}
 
-	token(): pos_(invalid_token_index), line_(-1), type_(token_type::invalid), text_(""), valid_(false)
+	token(): pos_(invalid_token_index), line_(-1), type_(token_type::invalid), value_()
 	{
 		
 	}
 
 	[[nodiscard]] std::string to_string_simple() const
 	{
-		if (type_ == token_type::symbol)
+		if (has_text(type_))
 		{
 			std::stringstream ret;
 			ret << ::to_string(type_) << "(" << text_ << ")";
@@ -145,7 +160,7 @@ public:
 	
 	[[nodiscard]] std::string to_string() const
 	{
-		if(type_ == token_type::symbol)
+		if(has_text(type_))
 		{
 			std::stringstream ret;
 			ret << "Token of type " << ::to_string(type_) << " " << text_ << " found at pos " << pos_;
@@ -169,7 +184,8 @@ public:
 		return type_;
 	}
 
-	[[nodiscard]] const std::string& get_text() const
+	// View into the source_buffer the token was lexed from.
+	[[nodiscard]] std::string_view get_text() const
 	{
 		return text_;
 	}
@@ -179,6 +195,21 @@ public:
 		return line_;
 	}
 
+	[[nodiscard]] std::int32_t get_integer() const
+	{
+		return value_.integer;
+	}
+
+	[[nodiscard]] double get_double() const
+	{
+		return value_.floating;
+	}
+
+	[[nodiscard]] token_value get_value() const
+	{
+		return value_;
+	}
+
 	[[nodiscard]] std::uint32_t get_pos() const
 	{
 		return pos_;
@@ -186,132 +217,847 @@ public:
 
 	[[nodiscard]] bool is_valid() const
 	{
-		return valid_;
+		return type_ != token_type::invalid;
 	}
 	
 private:
 	std::uint32_t pos_;
 	std::uint32_t line_;
 	token_type type_;
-	std::string text_;
-	bool valid_;
+	std::string_view text_;
+	token_value value_;
 };
 
-using token_array = std::vector<token>;
-using tokendelim_array = std::vector<token_delim>;
-
-const static tokendelim_array tokenDelims_ = {
-		{" ", token_type::space},
-		{",", token_type::comma},
-		{"(", token_type::lparen},
-		{")", token_type::rparen},
-		{"{", token_type::lbrace},
-		{"}", token_type::rbrace},
-		{"[", token_type::lbracket},
-		{"]", token_type::rbracket},
-		{":", token_type::colon},
-		{";", token_type::semicolon},
-		{"=", token_type::equal},
-		{"*", token_type::asterisk},
-		{"\r", token_type::carriagereturn},
-		{"+", token_type::plus},
-		{"-", token_type::minus},
-		{"/", token_type::forward_slash},
-		{"^", token_type::carrot},
-		{"pow", token_type::pow},
-		{"\n", token_type::newline},
 
+// Tokens of a single source_buffer. Holds a reference to the buffer so token text stays valid for as
+// long as any copy of the array is alive.
+class token_array
+{
+public:
+	using iterator = std::vector<token>::iterator;
+	using const_iterator = std::vector<token>::const_iterator;
+
+	token_array() = default;
+
+	explicit token_array(source_buffer_ptr source) : source_(std::move(source))
+	{
+
+	}
+
+	token_array(source_buffer_ptr source, const_iterator first, const_iterator last) : source_(std::move(source)), tokens_(first, last)
+	{
+
+	}
+
+	template<typename ...Args>
+	token& emplace_back(Args&&... args)
+	{
+		return tokens_.emplace_back(std::forward<Args>(args)...);
+	}
+
+	void push_back(const token& tok)
+	{
+		tokens_.push_back(tok);
+	}
+
+	void reserve(const std::size_t count)
+	{
+		tokens_.reserve(count);
+	}
+
+	iterator erase(const_iterator first, const_iterator last)
+	{
+		return tokens_.erase(first, last);
+	}
+
+	iterator erase(const_iterator position)
+	{
+		return tokens_.erase(position);
+	}
+
+	[[nodiscard]] const source_buffer_ptr& get_source() const
+	{
+		return source_;
+	}
+
+	[[nodiscard]] std::size_t size() const
+	{
+		return tokens_.size();
+	}
+
+	[[nodiscard]] bool empty() const
+	{
+		return tokens_.empty();
+	}
+
+	token& operator[](const std::size_t index)
+	{
+		return tokens_[index];
+	}
+
+	const token& operator[](const std::size_t index) const
+	{
+		return tokens_[index];
+	}
+
+	token* data()
+	{
+		return tokens_.data();
+	}
+
+	iterator begin() { return tokens_.begin(); }
+	iterator end() { return tokens_.end(); }
+	const_iterator begin() const { return tokens_.begin(); }
+	const_iterator end() const { return tokens_.end(); }
+
+private:
+	source_buffer_ptr source_;
+	std::vector<token> tokens_;
 };
 
-class tokenizer
+// Structure of arrays form of a token_array. Token types are stored as one byte each, apart from the
+// text and position data, so the type scans the parser does stay in cache. A token is only
+// materialized when something asks for its text or position.
+class token_stream
 {
 public:
-	static token_array tokenize(const std::string& raw_input);
-	static token_array tokenize(std::ifstream& file);
-private:
-	static std::size_t next_token_pos(const std::string& original, const std::size_t offset, token& parsed, std::int32_t lineNumber)
+	token_stream() = default;
+
+	explicit token_stream(source_buffer_ptr source) : source_(std::move(source))
 	{
-		const auto input = original.substr(offset);
 
-		for (std::uint32_t i = 0; i < input.length(); i++)
+	}
+
+	static token_stream from_token_array(const token_array& tokens)
+	{
+		token_stream stream(tokens.get_source());
+		stream.reserve(tokens.size());
+
+		for (const auto& tok : tokens)
 		{
-			const std::string_view view(input.c_str() + i, input.length() - i);
+			const auto offset = std::uint32_t(tok.get_text().data() - stream.source_->data());
+			stream.push_back(tok.get_type(), offset, std::uint32_t(tok.length()), tok.get_line(), tok.get_pos(), tok.get_value());
+		}
 
-			for (const auto& token_delim : tokenDelims_)
+		stream.match_brackets();
+		return stream;
+	}
+
+	void push_back(const token_type type, const std::uint32_t offset, const std::uint32_t length, const std::uint32_t line, const std::uint32_t pos, const token_value value = {})
+	{
+		types_.push_back(static_cast<std::uint8_t>(type));
+		offsets_.push_back(offset);
+		lengths_.push_back(length);
+		lines_.push_back(line);
+		positions_.push_back(pos);
+		values_.push_back(value);
+	}
+
+	void reserve(const std::size_t count)
+	{
+		types_.reserve(count);
+		offsets_.reserve(count);
+		lengths_.reserve(count);
+		lines_.reserve(count);
+		positions_.reserve(count);
+		values_.reserve(count);
+	}
+
+	void erase(const std::size_t index)
+	{
+		types_.erase(types_.begin() + index);
+		offsets_.erase(offsets_.begin() + index);
+		lengths_.erase(lengths_.begin() + index);
+		lines_.erase(lines_.begin() + index);
+		positions_.erase(positions_.begin() + index);
+		values_.erase(values_.begin() + index);
+		match_brackets();
+	}
+
+	// Pairs every '(' with its ')' and every '{' with its '}' in one stack pass, so bracket queries are a
+	// table lookup. Brackets without a partner of the same kind map to invalid_token_index.
+	void match_brackets()
+	{
+		matches_.assign(size(), invalid_token_index);
+
+		std::vector<std::uint32_t> open;
+
+		for (std::uint32_t i = 0; i < size(); i++)
+		{
+			switch (get_type(i))
+			{
+			case token_type::lparen:
+			case token_type::lbrace:
+				open.push_back(i);
+				break;
+			case token_type::rparen:
+			case token_type::rbrace:
 			{
-				const auto match_length = token_delim.match(view);
-				if (match_length > 0)
+				const auto opener = get_type(i) == token_type::rparen ? token_type::lparen : token_type::lbrace;
+
+				if (!open.empty() && get_type(open.back()) == opener)
 				{
-					parsed = token(i + offset, lineNumber, token_delim.get_type(), token_delim.get_delim());
-					return i + offset;
+					matches_[open.back()] = i;
+					matches_[i] = open.back();
+					open.pop_back();
 				}
 			}
+			break;
+			default:
+				break;
+			}
 		}
+	}
 
-		return invalid_token_index;
+	// Copies the tokens in [first, last) into a new stream over the same source_buffer.
+	[[nodiscard]] token_stream slice(const std::size_t first, const std::size_t last) const
+	{
+		token_stream result(source_);
+		result.types_.assign(types_.begin() + first, types_.begin() + last);
+		result.offsets_.assign(offsets_.begin() + first, offsets_.begin() + last);
+		result.lengths_.assign(lengths_.begin() + first, lengths_.begin() + last);
+		result.lines_.assign(lines_.begin() + first, lines_.begin() + last);
+		result.positions_.assign(positions_.begin() + first, positions_.begin() + last);
+		result.values_.assign(values_.begin() + first, values_.begin() + last);
+		result.match_brackets();
+		return result;
+	}
+
+	// Copy of the stream with every token of the given type dropped.
+	[[nodiscard]] token_stream without(const token_type type) const
+	{
+		token_stream result(source_);
+		result.reserve(size());
+
+		for (std::size_t i = 0; i < size(); i++)
+		{
+			if (types_[i] != static_cast<std::uint8_t>(type))
+				result.push_back(get_type(i), offsets_[i], lengths_[i], lines_[i], positions_[i], values_[i]);
+		}
+
+		result.match_brackets();
+		return result;
+	}
+
+	// Index of the first token of the given type in [first, last), or invalid_token_index.
+	[[nodiscard]] std::uint32_t find_first_of(const token_type type, const std::size_t first, const std::size_t last) const
+	{
+		if (first >= last || first >= size())
+			return invalid_token_index;
+
+		const auto* found = static_cast<const std::uint8_t*>(std::memchr(types_.data() + first, static_cast<std::uint8_t>(type), std::min(last, size()) - first));
+
+		return found ? std::uint32_t(found - types_.data()) : invalid_token_index;
+	}
+
+	// Index of the first token of the given type in [first, size()), or invalid_token_index.
+	[[nodiscard]] std::uint32_t find_first_of(const token_type type, const std::size_t first = 0) const
+	{
+		return find_first_of(type, first, size());
+	}
+
+	[[nodiscard]] token get(const std::size_t index) const
+	{
+		if (index >= size())
+			return token();
+
+		return token(positions_[index], lines_[index], get_type(index), get_text(index), values_[index]);
+	}
+
+	[[nodiscard]] token_type get_type(const std::size_t index) const
+	{
+		return static_cast<token_type>(types_[index]);
+	}
+
+	[[nodiscard]] std::string_view get_text(const std::size_t index) const
+	{
+		return source_->view().substr(offsets_[index], lengths_[index]);
+	}
+
+	[[nodiscard]] token_value get_value(const std::size_t index) const
+	{
+		return values_[index];
+	}
+
+	// Index of the bracket paired with the one at index, or invalid_token_index.
+	[[nodiscard]] std::uint32_t get_match(const std::size_t index) const
+	{
+		return index < matches_.size() ? matches_[index] : invalid_token_index;
+	}
+
+	[[nodiscard]] const std::uint8_t* types() const
+	{
+		return types_.data();
 	}
+
+	[[nodiscard]] token_array to_token_array() const
+	{
+		token_array tokens(source_);
+		tokens.reserve(size());
+
+		for (std::size_t i = 0; i < size(); i++)
+			tokens.push_back(get(i));
+
+		return tokens;
+	}
+
+	[[nodiscard]] const source_buffer_ptr& get_source() const
+	{
+		return source_;
+	}
+
+	[[nodiscard]] std::size_t size() const
+	{
+		return types_.size();
+	}
+
+	[[nodiscard]] bool empty() const
+	{
+		return types_.empty();
+	}
+
+private:
+	source_buffer_ptr source_;
+	std::vector<std::uint8_t> types_;
+	std::vector<std::uint32_t> offsets_;
+	std::vector<std::uint32_t> lengths_;
+	std::vector<std::uint32_t> lines_;
+	std::vector<std::uint32_t> positions_;
+	std::vector<token_value> values_;
+	std::vector<std::uint32_t> matches_;
 };
 
-inline token_array tokenizer::tokenize(const std::string& raw_input)
+// Maps every input byte to the delimiter token it starts. Bytes that can not start a delimiter are
+// part of a symbol. Multi character operators are keyed by their first byte and verified by the lexer.
+constexpr std::array<token_type, 256> make_char_class_table()
 {
-	token_array output;
-	std::int32_t lineNumber = 1;
-	
-	auto lines = split_string(raw_input, "\n");
+	std::array<token_type, 256> table{};
+
+	for (auto& entry : table)
+		entry = token_type::symbol;
+
+	table[' '] = token_type::space;
+	table[','] = token_type::comma;
+	table['('] = token_type::lparen;
+	table[')'] = token_type::rparen;
+	table['{'] = token_type::lbrace;
+	table['}'] = token_type::rbrace;
+	table['['] = token_type::lbracket;
+	table[']'] = token_type::rbracket;
+	table[':'] = token_type::colon;
+	table[';'] = token_type::semicolon;
+	table['='] = token_type::equal;
+	table['*'] = token_type::asterisk;
+	table['\r'] = token_type::carriagereturn;
+	table['+'] = token_type::plus;
+	table['-'] = token_type::minus;
+	table['/'] = token_type::forward_slash;
+	table['^'] = token_type::carrot;
+	table['p'] = token_type::pow;
+	table['\n'] = token_type::newline;
+
+	return table;
+}
+
+constexpr auto char_class_table = make_char_class_table();
+
+// Bytes that start a delimiter other than a space or newline, derived from char_class_table.
+constexpr std::size_t count_delimiter_bytes()
+{
+	std::size_t count = 0;
+
+	for (const auto type : char_class_table)
+	{
+		if (type != token_type::symbol && type != token_type::space && type != token_type::newline)
+			count++;
+	}
+
+	return count;
+}
+
+constexpr std::array<char, count_delimiter_bytes()> make_delimiter_bytes()
+{
+	std::array<char, count_delimiter_bytes()> bytes{};
+	std::size_t count = 0;
+
+	for (std::size_t i = 0; i < char_class_table.size(); i++)
+	{
+		const auto type = char_class_table[i];
+
+		if (type != token_type::symbol && type != token_type::space && type != token_type::newline)
+			bytes[count++] = char(i);
+	}
+
+	return bytes;
+}
+
+constexpr auto delimiter_bytes = make_delimiter_bytes();
+
+// Nibble tables for matching delimiter_bytes with a byte shuffle. Every distinct high nibble gets its own
+// bit, a byte is a delimiter when low_nibble_table[byte & 0xF] & high_nibble_table[byte >> 4] is non zero.
+struct delimiter_nibble_tables
+{
+	std::array<std::uint8_t, 16> low;
+	std::array<std::uint8_t, 16> high;
+	std::size_t high_nibble_count;
+};
+
+constexpr delimiter_nibble_tables make_delimiter_nibble_tables()
+{
+	delimiter_nibble_tables tables{};
+	std::array<bool, 16> seen{};
+
+	for (const auto byte : delimiter_bytes)
+	{
+		const auto high = static_cast<std::uint8_t>(byte) >> 4;
 
-	for (auto& line : lines) {
+		if (seen[high])
+			continue;
 
-		auto last_token_end_pos = 0;
+		// Counted past 8 so the assert below sees every nibble, only the first 8 fit in the mask.
+		seen[high] = true;
 
-		for (std::uint32_t i = 0; i < line.length();)
+		if (tables.high_nibble_count < 8)
+			tables.high[high] = std::uint8_t(1 << tables.high_nibble_count);
+
+		tables.high_nibble_count++;
+	}
+
+	for (const auto byte : delimiter_bytes)
+		tables.low[static_cast<std::uint8_t>(byte) & 0xF] |= tables.high[static_cast<std::uint8_t>(byte) >> 4];
+
+	return tables;
+}
+
+constexpr auto delimiter_nibbles = make_delimiter_nibble_tables();
+
+static_assert(delimiter_nibbles.high_nibble_count <= 8, "Delimiter bytes span more high nibbles than fit in a byte mask.");
+
+struct keyword
+{
+	std::string_view text;
+	token_type type;
+};
+
+constexpr std::array<keyword, 3> keywords = { {
+	{ "fun", token_type::kw_fun },
+	{ "var", token_type::kw_var },
+	{ "return", token_type::kw_return }
+} };
+
+// Perfect hash over keywords: fnv1a with a seed chosen at compile time so every keyword lands in its
+// own slot of keyword_table.
+constexpr std::size_t keyword_table_bits = 3;
+constexpr std::size_t keyword_table_size = std::size_t(1) << keyword_table_bits;
+
+constexpr std::size_t keyword_slot(const std::string_view text, const std::uint32_t seed)
+{
+	// The high bits of fnv1a are the well mixed ones.
+	return hash_32_fnv1a(text.data(), text.size(), seed) >> (32 - keyword_table_bits);
+}
+
+constexpr std::uint32_t find_keyword_seed()
+{
+	for (std::uint32_t seed = val_32_const; seed < val_32_const + 1024; seed++)
+	{
+		std::array<bool, keyword_table_size> used{};
+		bool collision = false;
+
+		for (const auto& kw : keywords)
 		{
-			token found_token;
+			auto& slot = used[keyword_slot(kw.text, seed)];
+			collision |= slot;
+			slot = true;
+		}
+
+		if (!collision)
+			return seed;
+	}
+
+	return 0;
+}
+
+constexpr auto keyword_seed = find_keyword_seed();
+
+static_assert(keyword_seed != 0, "No collision free seed for the keyword table, increase keyword_table_size.");
+
+constexpr std::array<keyword, keyword_table_size> make_keyword_table()
+{
+	std::array<keyword, keyword_table_size> table{};
+
+	for (auto& entry : table)
+		entry = { "", token_type::symbol };
+
+	for (const auto& kw : keywords)
+		table[keyword_slot(kw.text, keyword_seed)] = kw;
+
+	return table;
+}
+
+constexpr auto keyword_table = make_keyword_table();
+
+enum class simd_level
+{
+	scalar,
+	sse2,
+	avx2
+};
+
+// Bit i of each mask is set when byte i of a 64 byte block is of that class.
+struct structural_block
+{
+	std::uint64_t delimiter;
+	std::uint64_t whitespace;
+	std::uint64_t newline;
+};
+
+// First lexer stage. Classifies the input 64 bytes at a time into delimiter, whitespace and newline
+// bitmasks, so the token builder only visits bytes that can end a symbol.
+class structural_indexer
+{
+public:
+	static constexpr std::size_t block_size = 64;
 
-			const auto found_token_pos = next_token_pos(line, last_token_end_pos, found_token, lineNumber);
+	using classifier = structural_block(*)(const char* block);
 
-			if (found_token_pos != invalid_token_index)
+	static simd_level detect()
+	{
+#if defined(BEAN_SIMD_X86)
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+
+		if (info[0] >= 7)
+		{
+			__cpuid(info, 1);
+			const bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+			__cpuidex(info, 7, 0);
+
+			if (os_saves_ymm && (info[1] & (1 << 5)))
+				return simd_level::avx2;
+		}
+#else
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2"))
+			return simd_level::avx2;
+#endif
+		return simd_level::sse2;
+#else
+		return simd_level::scalar;
+#endif
+	}
+
+	// Best level the running cpu supports, detected once.
+	static simd_level best()
+	{
+		static const auto level = detect();
+		return level;
+	}
+
+	static classifier get_classifier(const simd_level level)
+	{
+		switch (level)
+		{
+#if defined(BEAN_SIMD_X86)
+		case simd_level::avx2:
+			return classify_avx2;
+		case simd_level::sse2:
+			return classify_sse2;
+#endif
+		default:
+			return classify_scalar;
+		}
+	}
+
+	static std::uint32_t trailing_zeros(const std::uint64_t mask)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, mask);
+		return index;
+#elif defined(__GNUC__)
+		return std::uint32_t(__builtin_ctzll(mask));
+#else
+		std::uint32_t index = 0;
+		while (!(mask & (std::uint64_t(1) << index)))
+			index++;
+		return index;
+#endif
+	}
+
+	static structural_block classify_scalar(const char* block)
+	{
+		structural_block result{ 0, 0, 0 };
+
+		for (std::size_t i = 0; i < block_size; i++)
+		{
+			const auto type = char_class_table[static_cast<std::uint8_t>(block[i])];
+			const auto bit = std::uint64_t(1) << i;
+
+			if (type == token_type::space)
+				result.whitespace |= bit;
+			else if (type == token_type::newline)
+				result.newline |= bit;
+			else if (type != token_type::symbol)
+				result.delimiter |= bit;
+		}
+
+		return result;
+	}
+
+#if defined(BEAN_SIMD_X86)
+	template<std::size_t ...I>
+	static __m128i match_delimiters_sse2(const __m128i input, std::index_sequence<I...>)
+	{
+		// SSE2 has no byte shuffle, compare against every delimiter byte.
+		auto result = _mm_setzero_si128();
+		((result = _mm_or_si128(result, _mm_cmpeq_epi8(input, _mm_set1_epi8(delimiter_bytes[I])))), ...);
+		return result;
+	}
+
+	static structural_block classify_sse2(const char* block)
+	{
+		structural_block result{ 0, 0, 0 };
+
+		for (std::size_t offset = 0; offset < block_size; offset += 16)
+		{
+			const auto input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + offset));
+			const auto delimiter = match_delimiters_sse2(input, std::make_index_sequence<delimiter_bytes.size()>());
+
+			result.delimiter |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(delimiter))) << offset;
+			result.whitespace |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(input, _mm_set1_epi8(' '))))) << offset;
+			result.newline |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(input, _mm_set1_epi8('\n'))))) << offset;
+		}
+
+		return result;
+	}
+
+	BEAN_TARGET_AVX2 static structural_block classify_avx2(const char* block)
+	{
+		structural_block result{ 0, 0, 0 };
+
+		const auto low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(delimiter_nibbles.low.data())));
+		const auto high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(delimiter_nibbles.high.data())));
+		const auto nibble_mask = _mm256_set1_epi8(0x0F);
+
+		for (std::size_t offset = 0; offset < block_size; offset += 32)
+		{
+			const auto input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + offset));
+
+			const auto low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(input, nibble_mask));
+			const auto high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask));
+			const auto delimiter = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+
+			result.delimiter |= std::uint64_t(~std::uint32_t(_mm256_movemask_epi8(delimiter))) << offset;
+			result.whitespace |= std::uint64_t(std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(input, _mm256_set1_epi8(' '))))) << offset;
+			result.newline |= std::uint64_t(std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n'))))) << offset;
+		}
+
+		return result;
+	}
+#endif
+};
+
+
+class tokenizer
+{
+public:
+	static token_stream tokenize_stream(const source_buffer_ptr& source, simd_level level = structural_indexer::best());
+	static token_stream tokenize_stream(const std::string& raw_input);
+	static token_array tokenize(const source_buffer_ptr& source);
+	static token_array tokenize(const std::string& raw_input);
+	static token_array tokenize(std::ifstream& file);
+	static token_array tokenize_file(const std::string& file_path);
+
+	// Type of the token a symbol's text forms: a keyword, a literal whose parsed value is stored in value,
+	// or a plain symbol.
+	static token_type classify_symbol(const std::string_view text, token_value& value)
+	{
+		const auto first = text.front();
+
+		if ((first >= '0' && first <= '9') || first == '.')
+		{
+			const auto* const end = text.data() + text.size();
+
+			if (const auto result = std::from_chars(text.data(), end, value.integer); result.ec == std::errc() && result.ptr == end)
+				return token_type::integer_literal;
+
+			if (const auto result = std::from_chars(text.data(), end, value.floating); result.ec == std::errc() && result.ptr == end)
+				return token_type::double_literal;
+
+			// strtod also reads hexadecimal doubles, from_chars takes them without the prefix.
+			if (text.size() > 2 && first == '0' && (text[1] | 0x20) == 'x' && text[2] != '-')
 			{
-				if (found_token_pos > last_token_end_pos)
-				{
-					// symbol lives between tokens
-					output.emplace_back(last_token_end_pos, lineNumber, token_type::symbol, line.substr(last_token_end_pos, found_token_pos + found_token.length() - last_token_end_pos - 1));
-				}
+				if (const auto result = std::from_chars(text.data() + 2, end, value.floating, std::chars_format::hex); result.ec == std::errc() && result.ptr == end)
+					return token_type::double_literal;
+			}
+
+			return token_type::symbol;
+		}
+
+		const auto& entry = keyword_table[keyword_slot(text, keyword_seed)];
+
+		return entry.text == text ? entry.type : token_type::symbol;
+	}
+
+	// The words strtod reads as numbers, in any case. They stay symbols, so they can still name variables and
+	// functions, and the parser reads them as doubles where it expects a value.
+	static bool read_number_word(const std::string_view text, double& value)
+	{
+		const auto matches = [text](const std::string_view word)
+		{
+			return text.size() == word.size() && std::equal(text.begin(), text.end(), word.begin(), [](const char lh, const char rh) { return (lh | 0x20) == rh; });
+		};
+
+		if (matches("nan"))
+		{
+			value = std::numeric_limits<double>::quiet_NaN();
+			return true;
+		}
+
+		if (matches("inf") || matches("infinity"))
+		{
+			value = std::numeric_limits<double>::infinity();
+			return true;
+		}
+
+		return false;
+	}
+private:
+	// Length of the delimiter starting at offset, 0 when the byte belongs to a symbol.
+	static std::size_t match_delim(const std::string_view input, const std::size_t offset, const token_type type)
+	{
+		switch (type)
+		{
+		case token_type::symbol:
+			return 0;
+		case token_type::pow:
+			return input.compare(offset, 3, "pow") == 0 ? 3 : 0;
+		default:
+			return 1;
+		}
+	}
+};
+
+inline token_stream tokenizer::tokenize_stream(const source_buffer_ptr& source, const simd_level level)
+{
+	const auto raw_input = source->view();
+	const auto classify = structural_indexer::get_classifier(level);
+
+	token_stream output(source);
+	output.reserve(raw_input.length() / 4);
+
+	std::uint32_t line_number = 1;
+	std::size_t line_start = 0;
+	std::size_t symbol_start = 0;
+
+	const auto emit_symbol = [&](const std::size_t symbol_end)
+	{
+		if (symbol_end > symbol_start)
+		{
+			token_value value{};
+			const auto type = classify_symbol(raw_input.substr(symbol_start, symbol_end - symbol_start), value);
+
+			output.push_back(type, std::uint32_t(symbol_start), std::uint32_t(symbol_end - symbol_start), line_number, std::uint32_t(symbol_start - line_start), value);
+		}
+	};
+
+	for (std::size_t block_start = 0; block_start < raw_input.length(); block_start += structural_indexer::block_size)
+	{
+		structural_block block;
+
+		if (raw_input.length() - block_start >= structural_indexer::block_size)
+		{
+			block = classify(raw_input.data() + block_start);
+		}
+		else
+		{
+			// Pad the tail with zero bytes, which classify as part of a symbol.
+			char tail[structural_indexer::block_size] = {};
+			std::memcpy(tail, raw_input.data() + block_start, raw_input.length() - block_start);
+			block = classify(tail);
+		}
+
+		// Only bytes that can end a symbol are visited, everything in between is symbol text.
+		for (auto structurals = block.delimiter | block.whitespace | block.newline; structurals != 0; structurals &= structurals - 1)
+		{
+			const auto i = block_start + structural_indexer::trailing_zeros(structurals);
+
+			// Skip bytes already consumed by a multi character operator.
+			if (i < symbol_start)
+				continue;
 
-				output.emplace_back(found_token);
-				last_token_end_pos = found_token_pos + found_token.length();
-				i = last_token_end_pos;
+			const auto type = char_class_table[static_cast<std::uint8_t>(raw_input[i])];
+			const auto delim_length = match_delim(raw_input, i, type);
+
+			if (delim_length == 0)
+				continue;
+
+			emit_symbol(i);
+
+			if (type == token_type::newline)
+			{
+				// Newlines only advance the line count, they are never emitted.
+				line_number++;
+				line_start = i + 1;
 			}
 			else
 			{
-				// No end token exist. Symbol is the last bit of the line.
-				output.emplace_back(last_token_end_pos, lineNumber, token_type::symbol, line.substr(last_token_end_pos, line.size() - last_token_end_pos));
-				i += line.size() - last_token_end_pos;
+				output.push_back(type, std::uint32_t(i), std::uint32_t(delim_length), line_number, std::uint32_t(i - line_start));
 			}
-		}
 
-		lineNumber++;
+			symbol_start = i + delim_length;
+		}
 	}
-		
+
+	emit_symbol(raw_input.length());
+
+	output.match_brackets();
 	return output;
 }
 
+inline token_stream tokenizer::tokenize_stream(const std::string& raw_input)
+{
+	return tokenize_stream(source_buffer::create(raw_input));
+}
+
+inline token_array tokenizer::tokenize(const source_buffer_ptr& source)
+{
+	return tokenize_stream(source).to_token_array();
+}
+
+inline token_array tokenizer::tokenize(const std::string& raw_input)
+{
+	return tokenize(source_buffer::create(raw_input));
+}
+
 inline token_array tokenizer::tokenize(std::ifstream& file)
 {
-	return tokenize(std::string((std::istreambuf_iterator<char>(file)),
-		std::istreambuf_iterator<char>()));
+	return tokenize(source_buffer::read_stream(file));
+}
+
+inline token_array tokenizer::tokenize_file(const std::string& file_path)
+{
+	return tokenize(source_buffer::map_file(file_path));
 }
 
 
+// View over a range of a shared token_stream with space tokens removed. The stream is filtered once on
+// construction; splice, split and get_rest only narrow the [begin, end) window, so slicing never copies
+// tokens. Indices passed to and returned from the iterator are relative to the start of the view.
 class token_iterator
 {
 public:
 
-	token_iterator(token_array tokens, std::uint32_t token_index = invalid_token_index) : tokens_(std::move(tokens)), token_index_(token_index)
+	token_iterator(const token_stream& tokens, std::uint32_t token_index = invalid_token_index) : token_iterator(std::make_shared<const token_stream>(tokens.without(token_type::space)), token_index)
 	{
-		tokens_.erase(std::remove_if(tokens_.begin(), tokens_.end(), [&](token tok)
-		{
-			return tok.get_type() == token_type::space;
-		}), tokens_.end());
+
+	}
+
+	token_iterator(const token_array& tokens, std::uint32_t token_index = invalid_token_index) : token_iterator(token_stream::from_token_array(tokens), token_index)
+	{
+
 	}
 
 	auto here_details()
@@ -324,65 +1070,71 @@ public:
 		next();
 		return here_details();
 	}
-	
-	token& here()
+
+	token here()
 	{
 		return get_or_invalid(token_index_);
 	}
-	
-	token& peek_next()
+
+	token peek_next()
 	{
 		return get_or_invalid(token_index_ + 1);
 	}
 
-	token& next()
+	token next()
 	{
 		token_index_++;
 		return get_or_invalid(token_index_);
 	}
 
-	token& peek_before()
+	token peek_before()
 	{
 		return get_or_invalid(token_index_ - 1);
 	}
-	
-	token& before()
+
+	token before()
 	{
 		token_index_--;
 		return get_or_invalid(token_index_);
 	}
 
-	token& get_offset(const std::int32_t offset)
+	token get_offset(const std::int32_t offset)
 	{
 		return get_or_invalid(token_index_ + offset);
 	}
 
-	token& find_next(const token_type type)
+	token find_next(const token_type type)
 	{
-		while(next().is_valid())
+		const auto found = find_first_of(type);
+
+		if (found == invalid_token_index)
 		{
-			if (here().get_type() == type)
-				return here();
+			token_index_ = std::uint32_t(size());
+			return token();
 		}
-		return invalid_token_;
+
+		token_index_ = found;
+		return here();
 	}
 
-	token& jump_to(const std::uint32_t token_index)
+	token jump_to(const std::uint32_t token_index)
 	{
-		if (token_index < 0 || token_index >= tokens_.size())
-			return invalid_token_;
+		if (token_index >= size())
+			return token();
 
 		token_index_ = token_index;
 
 		return get_or_invalid(token_index_);
 	}
-	
-	token& get_or_invalid(const std::uint32_t index)
+
+	token get_or_invalid(const std::uint32_t index) const
 	{
-		if(index < 0 || index >= tokens_.size())
-			return invalid_token_;
+		return index < size() ? tokens_->get(begin_ + index) : token();
+	}
 
-		return tokens_[index];
+	[[nodiscard]] token_type get_type(const std::uint32_t index) const
+	{
+		return index < size() ? tokens_->get_type(begin_ + index) : token_type::invalid;
 	}
 
 	[[nodiscard]] std::uint32_t get_index() const
@@ -392,7 +1144,7 @@ public:
 
 	token_iterator get_rest()
 	{
-		return token_iterator(token_array(tokens_.begin() + get_index() + 1, tokens_.begin() + size()));
+		return splice(get_index() + 1, std::uint32_t(size()));
 	}
 
 	std::vector<token_iterator> split(const token_type delimiter)
@@ -400,78 +1152,95 @@ public:
 		std::vector<token_iterator> result;
 
 		int last_split = 0;
-		
+
 		for(int i = 0; i < size();i++)
 		{
-			if(get_or_invalid(i).get_type() == delimiter)
+			if(get_type(i) == delimiter)
 			{
 				result.push_back(splice(last_split + 0, i));
 				last_split = i;
 			}
 		}
 
-		result.push_back(splice(last_split + 1, size()));
-	
+		result.push_back(splice(last_split + 1, std::uint32_t(size())));
+
 
 		return result;
 	}
-	
-	token_iterator splice(const std::uint32_t start, const std::uint32_t end)
+
+	// View of [start, end) of this view, sharing the same token_stream.
+	token_iterator splice(const std::uint32_t start, const std::uint32_t end) const
 	{
-		return token_iterator(token_array(tokens_.begin() + start, tokens_.begin() + end));
+		const auto first = std::min(start, std::uint32_t(size()));
+		const auto last = std::max(first, std::min(end, std::uint32_t(size())));
+
+		return token_iterator(tokens_, begin_ + first, begin_ + last);
 	}
 
 	std::uint32_t find_first_of(const token_type type)
 	{
-		const std::uint32_t o_pos = get_index();
-
-		while (next().is_valid())
-		{
-			if (here().get_type() == type) {
-				const std::uint32_t found_pos = get_index();
-				jump_to(o_pos);
-				return found_pos;
-			}
-		}
+		const auto found = tokens_->find_first_of(type, begin_ + std::uint32_t(get_index() + 1), end_);
 
-		jump_to(o_pos);
-
-		return invalid_token_index;
+		return found == invalid_token_index ? invalid_token_index : found - begin_;
 	}
-	
+
+	// Position of the bracket closing the first open bracket after the current token.
 	std::uint32_t find_last_pos_of_open_close(const token_type open, const token_type close) {
 
-		std::uint32_t stack = 0;
+		const auto opened = find_first_of(open);
 
-		const std::uint32_t o_pos = get_index();
+		if (opened == invalid_token_index)
+			return invalid_token_index;
 
-		while (next().is_valid())
-		{
-			if (here().get_type() == open)
-				stack++;
-			if (here().get_type() == close) {
-				stack--;
-				if (stack == 0) {
-					const std::uint32_t found_pos = get_index();
-					jump_to(o_pos);
-					return found_pos;
-				}
-			}
-		}
+		const auto closed = get_match(opened);
 
-		jump_to(o_pos);
+		return get_type(closed) == close ? closed : invalid_token_index;
+	}
 
-		return invalid_token_index;
+	// View relative index of the bracket paired with the one at index, or invalid_token_index when it has
+	// no partner inside the view.
+	[[nodiscard]] std::uint32_t get_match(const std::uint32_t index) const
+	{
+		if (index >= size())
+			return invalid_token_index;
+
+		const auto match = tokens_->get_match(begin_ + index);
+
+		return match >= begin_ && match < end_ ? match - begin_ : invalid_token_index;
 	}
 
+	// Materializes the tokens of the view. This is the only operation that copies.
 	token_array get_tokens() const
 	{
-		return tokens_;
+		token_array tokens(tokens_->get_source());
+		tokens.reserve(size());
+
+		for (std::uint32_t i = 0; i < size(); i++)
+			tokens.push_back(get_or_invalid(i));
+
+		return tokens;
+	}
+
+	// The whole shared stream the view indexes into, use get_begin() to map view indices onto it.
+	const token_stream& get_stream() const
+	{
+		return *tokens_;
+	}
+
+	[[nodiscard]] std::uint32_t get_begin() const
+	{
+		return begin_;
+	}
+
+	// Type bytes of the view, indexable by view relative index.
+	[[nodiscard]] const std::uint8_t* types() const
+	{
+		return tokens_->types() + begin_;
 	}
 
 	std::size_t size() const
 	{
-		return tokens_.size();
+		return end_ - begin_;
 	}
 
 	bool empty() const
@@ -481,41 +1250,24 @@ public:
 
 	std::uint32_t find_rightmost_of(const token_type type, const bool avoidParen = true)
 	{
-		for(int i = size() - 1; i >= int(token_index_); i--)
+		for(int i = int(size()) - 1; i >= int(token_index_); i--)
 		{
-			auto tokenType = get_or_invalid(i).get_type();
+			auto tokenType = get_type(i);
 
-			if (avoidParen) {
-				if (tokenType == token_type::rparen)
-				{
-					// account for first one
-					int parenCount = 1;
-					
-					for (int j = i - 1; j >= 0; j--)
-					{
-						auto parenToken = get_or_invalid(j);
-						
-						if (get_or_invalid(j).get_type() == token_type::rparen)
-							parenCount++;
-
-						if (get_or_invalid(j).get_type() == token_type::lparen)
-						{
-							parenCount--;
-							if (parenCount == 0) {
-								i = j - 1;
-								goto outParenCheck;
-							}
-						}
-						
-					}
+			if (avoidParen && tokenType == token_type::rparen)
+			{
+				// Skip over the parenthesized group.
+				const auto match = get_match(i);
 
+				if (match != invalid_token_index)
+				{
+					i = int(match) - 1;
 				}
+
+				// update token incase paren check change 'i'
+				tokenType = get_type(i);
 			}
-			outParenCheck:
 
-			// update token incase paren check change 'i'
-			tokenType = get_or_invalid(i).get_type();
-			
 			if (tokenType == type)
 				return i;
 		}
@@ -525,7 +1277,7 @@ public:
 	std::uint32_t find_rightmost_of(const std::vector<token_type> types)
 	{
 		std::uint32_t maxOffset = invalid_token_index;
-		
+
 		for (auto type : types)
 		{
 			const auto off = find_rightmost_of(type);
@@ -543,7 +1295,7 @@ public:
 		}
 		return maxOffset;
 	}
-	
+
 	std::uint32_t find_rightmost_of_pemdas()
 	{
 		const std::vector<std::vector<token_type>> typeOrder = {
@@ -575,69 +1327,82 @@ public:
 		// If we don't find a operator, just go left to right and return the first symbol.
 		for(int i = token_index_; i < this->size(); i++)
 		{
-			if(get_or_invalid(i).get_type() == token_type::symbol)
+			if(get_type(i) == token_type::symbol)
 			{
 				return i;
 			}
 		}
-		
+
 		return invalid_token_index;
 	}
 
+	// Removing the first or last token narrows the view. Removing from the middle detaches the view onto
+	// its own copy of the tokens first, so other views of the stream are unaffected.
 	void remove(std::uint32_t index)
 	{
-		if(get_or_invalid(index).is_valid())
+		if(index < size())
 		{
-			tokens_.erase(tokens_.begin() + index);
+			if (index == 0)
+			{
+				begin_++;
+			}
+			else if (index == size() - 1)
+			{
+				end_--;
+			}
+			else
+			{
+				auto detached = std::make_shared<token_stream>(tokens_->slice(begin_, end_));
+				detached->erase(index);
+
+				end_ = std::uint32_t(detached->size());
+				begin_ = 0;
+				tokens_ = std::move(detached);
+			}
 
-			if (token_index_ >= tokens_.size() && token_index_ != invalid_token_index)
+			if (token_index_ >= size() && token_index_ != invalid_token_index)
 				token_index_--;
 		}
 	}
 
 	bool is_type(std::uint32_t index, token_type type)
 	{
-		const auto foundToken = get_or_invalid(index);
-
-		if (foundToken.is_valid() && foundToken.get_type() == type)
-			return true;
-
-		return false;
+		return get_type(index) == type;
 	}
 
-	token* begin()
+	token first()
 	{
-		return tokens_.data();
+		return get_or_invalid(0);
 	}
 
-	token* end()
+	token last()
 	{
-		return tokens_.data() + (tokens_.size() - 1);
+		return get_or_invalid(std::uint32_t(size() - 1));
 	}
 
-	token& first()
+	void pop_front()
 	{
-		return *begin();
+		remove(0);
 	}
 
-	token& last()
+	void pop_end()
 	{
-		return *end();
+		remove(std::uint32_t(size() - 1));
 	}
 
-	void pop_front()
+private:
+	token_iterator(std::shared_ptr<const token_stream> tokens, std::uint32_t token_index) : tokens_(std::move(tokens)), begin_(0), end_(std::uint32_t(tokens_->size())), token_index_(token_index)
 	{
-		remove(0);
+
 	}
 
-	void pop_end()
+	token_iterator(std::shared_ptr<const token_stream> tokens, const std::uint32_t begin, const std::uint32_t end) : tokens_(std::move(tokens)), begin_(begin), end_(end), token_index_(invalid_token_index)
 	{
-		remove(tokens_.size() - 1);
+
 	}
-	
-private:
-	token_array tokens_;
-	token invalid_token_;
+
+	std::shared_ptr<const token_stream> tokens_;
+	std::uint32_t begin_;
+	std::uint32_t end_;
 	std::uint32_t token_index_;
 };
-